@@ -23,391 +23,6691 @@ SOFTWARE.
 */
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cerrno>
 #include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <functional>
-#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
-/* This mutex will lock our threads, until a new line is read and is ready
-to be parsed. */
-std::mutex mutex;
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-/* This condition variable is responsible for alerting mutex when things are
-ready. */
-std::condition_variable processCondition;
+/* The compression libraries are optional, see the Makefile. Without them
+we run the tools. */
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_LZMA
+#include <lzma.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
 
-std::ifstream::pos_type fileSize; // Total file size used for the status meter.
+/* io_uring needs nothing but the kernel headers, we make the syscalls
+ourselves. Without them --no-mmap reads the plain way. */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
 
-std::string help = "Usage: parsewinelog [yourlog.txt]"; // --help output.
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
-/* We need to know the total file size so we can output the progress meter. */
-std::ifstream::pos_type getFilesize(const std::string& filename)
-{
-    std::ifstream in(filename, std::ifstream::ate | std::ifstream::binary);
-    return in.tellg();
-}
+/* Per thread, a batch parses several logs at once. The threads we start
+have nothing to say but that something broke, that goes to stderr: the
+output may be stdout. main() starts on stdout. */
+thread_local uint64_t fileSize = 0; // Total file size used for the status meter.
+thread_local std::ostream* status = &std::cerr; // Our messages, stderr if we write to stdout.
+
+std::string help = "Usage: parsewinelog [--engine auto|chunked|pipeline] [--zstd] [--no-mmap]\n"
+        "                    [--include|--exclude PATTERNS] [--summary]\n"
+        "                    [--profile [--top N]] [--index] [--binary] [--threads N]\n"
+        "                    [--pin] [--max-mem MB] [--follow | --resume]\n"
+        "                    [--stats] [--stats-json FILE] [yourlog.txt... | dir | -]\n"
+        "       parsewinelog gen | bench [options], see parsewinelog gen\n"
+        "       parsewinelog extract [options] yourlog.txt, see parsewinelog extract\n"
+        "       parsewinelog dump [--unmatched] yourlog_parsed.txt.pwb\n"
+        "  -         read the log from stdin, write the result to stdout.\n"
+        "            wine app.exe 2>&1 | parsewinelog -\n"
+        "  --zstd    compress the output with zstd.\n"
+        "  --no-mmap read the file instead of mapping it, with io_uring if we may.\n"
+        "  --include DLL.Function,...  only look at the calls and rets of these,\n"
+        "            * and ? work, NTDLL alone is NTDLL.*.\n"
+        "  --exclude DLL.Function,...  drop the calls and rets of these.\n"
+        "            The other lines are kept either way.\n"
+        "  --summary count the calls and the unmatched calls of every function\n"
+        "            and Wine thread instead, no output file.\n"
+        "  --profile time the calls with the log's timestamps instead, the\n"
+        "            --top N functions (20) by inclusive and exclusive time.\n"
+        "            WINEDEBUG=+timestamp,+relay logs them.\n"
+        "  --binary  the calls also go to yourlog_parsed.txt.pwb, columns of\n"
+        "            their thread, function, return address, offset in the log\n"
+        "            and whether they were matched, with the function names.\n"
+        "            For the tools downstream to map, parsewinelog dump reads it.\n"
+        "  --index   read yourlog.txt.pwi instead of parsing the log again, or\n"
+        "            write it if there is none. The filters and reports work\n"
+        "            from it too.\n"
+        "  --stats   what went on, and where the time went, at the end.\n"
+        "  --stats-json FILE  the same as JSON.\n"
+        "  --engine  chunked classifies blocks of the file on all threads,\n"
+        "            pipeline reads on the main thread. auto picks chunked\n"
+        "            for regular files.\n"
+        "  --threads N  threads next to the main one, one per CPU we may use\n"
+        "            less one by default, the cgroup CPU quota counts.\n"
+        "  --pin     keep every thread on a CPU of its own, our NUMA node first.\n"
+        "  --max-mem MB  the calls still waiting for their ret and the lines\n"
+        "            waiting to be written go to temporary files past this.\n"
+        "  --follow  keep parsing what is added to the log, until Ctrl-C. Where\n"
+        "            we are goes to yourlog.txt.pws, the next run goes on from\n"
+        "            there. The lines behind a call still waiting for its ret\n"
+        "            are written when we stop.\n"
+        "  --resume  parse what was added since the last run, and stop.\n"
+        "Many logs, or a directory of them, are parsed in one go. The small\n"
+        "ones next to each other, the big ones one after the other.\n"
+        "gzip, xz and zstd compressed logs are decompressed on the fly."; // --help output.
 
 /* This is the progress bar. Mostly copied from
-https://www.ross.click/2011/02/creating-a-progress-bar-in-c-or-any-other-console-app/ */
-static inline void progressBar(unsigned int x, unsigned int n, unsigned int w = 50)
-{
-    if ( (x != n) && (x % (n/100+1) != 0) ) return;
+https://www.ross.click/2011/02/creating-a-progress-bar-in-c-or-any-other-console-app/
+It now lives on a thread of its own. The loops only bump two counters once
+per block, and a few times a second we look at them and draw the bar, with
+the throughput and how long it will still take. Pipes have no size, there we
+only show what went by. Nobody sees it if our messages don't go to a
+terminal, so then we don't draw anything. */
+struct Progress {
+    static const int width = 40;
 
-    float ratio  =  x/(float)n;
-    int   c      =  ratio * w;
+    Progress(uint64_t size, bool draw) : total(size), out(status)
+    {
+        if (draw)
+            reporter = std::thread(&Progress::run, this);
+    }
 
-    std::cout << std::setw(3) << (int)(ratio*100) << "% [";
-    for (int x=0; x<c; x++) std::cout << "=";
-    for (int x=c; x<w; x++) std::cout << " ";
-    std::cout << "]\r" << std::flush;
-}
+    ~Progress() { stop(); }
 
-/* A simple function to open the read file. */
-std::ifstream openInFile(std::string f)
-{
-    std::ifstream inFile(f, std::ios::in);
+    /* A block went by. */
+    void add(uint64_t n, uint64_t l)
+    {
+        bytes.fetch_add(n, std::memory_order_relaxed);
+        lines.fetch_add(l, std::memory_order_relaxed);
+    }
 
-    if (!inFile.is_open()) {
-        std::cout << "Couldn't read input file: " << f << std::endl;
-        inFile = std::ifstream();
-    } else {
-        fileSize = getFilesize(f);
-        std::cout << "Parsing: " << f
-                << " -- Filesize: " << fileSize/1000000 << " MB"
-                << std::endl;
+    /* Draw it one last time and stop. */
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeUp.notify_one();
+        if (reporter.joinable()) {
+            reporter.join();
+            *out << std::endl;
+        }
     }
 
-    return inFile;
-}
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            bool last = wakeUp.wait_for(lock, std::chrono::milliseconds(250),
+                    [&] { return stopping; });
+            draw();
+            if (last)
+                break;
+        }
+    }
 
-/* A simple function to open the output file. */
-std::ofstream openOutFile(std::string f)
-{
-    auto extPos = f.find_last_of(".");
-    std::string extension = f.substr(extPos);
-    std::string outFilename = f.substr(0, extPos);
-    f = outFilename + "_parsed" + extension;
-    std::ofstream outFile(f, std::ios::out);
+    void draw()
+    {
+        double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+        uint64_t b = bytes.load(std::memory_order_relaxed);
+        uint64_t l = lines.load(std::memory_order_relaxed);
+        double rate = seconds > 0 ? b / seconds : 0;
+
+        std::ostream& os = *out;
+        if (total) {
+            double ratio = std::min(1.0, b / static_cast<double>(total));
+            int c = ratio * width;
+            os << std::setw(3) << static_cast<int>(ratio * 100) << "% [";
+            for (int x = 0; x < c; x++)
+                os << "=";
+            for (int x = c; x < width; x++)
+                os << " ";
+            os << "] ";
+        } else {
+            os << b / 1000000 << " MB ";
+        }
+        os << std::fixed << std::setprecision(1) << rate / 1e6 << " MB/s "
+                << (seconds > 0 ? l / seconds : 0) / 1e6 << "M lines/s";
 
-    if (!outFile.is_open()) {
-        std::cout << "Couldn't create output file: " << f << std::endl;
-        outFile = std::ofstream();
+        if (total && rate > 0 && b < total) {
+            uint64_t eta = (total - b) / rate;
+            os << " ETA " << eta / 3600 << ":" << std::setfill('0')
+                    << std::setw(2) << eta / 60 % 60 << ":" << std::setw(2)
+                    << eta % 60 << std::setfill(' ');
+        }
+        os << "      \r" << std::flush; // Clear what was longer.
+        os.unsetf(std::ios::floatfield);
     }
 
-    return outFile;
+    uint64_t total; // 0 if we don't know.
+    std::ostream* out; // The status of whoever made us, ours is per thread.
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> lines{0};
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool stopping = false;
+    std::thread reporter;
+};
+
+static inline double secondsSince(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t)
+            .count();
 }
 
-/* Our actual work. Since the software requires to store the call, and later
-process it, we don't use std::function. Of course that would be a nicer way
-to go about it. All this does is either store a string, or compare the member
-string with another. */
-struct Parser {
-    /* Store the payload. */
-    Parser(std::string call) : Call(call) {}
+bool timeStages = false; // --stats, the stage timers run.
+bool profileCalls = false; // --profile, the threads time the calls they match.
+
+/* What a thread did, for --stats. Every thread counts in its own, so nobody
+shares a cache line, and they are added up at the end. The counters are
+always on, they are a few adds per line. The timers read the clock once per
+block or batch, so they only run with --stats. */
+struct Stats {
+    uint64_t bytes = 0;
+    uint64_t lines = 0;
+    uint64_t calls = 0;
+    uint64_t rets = 0;
+    uint64_t fastMatches = 0; // The call on top of the stack.
+    uint64_t fallbackMatches = 0; // A call deeper down.
+    uint64_t lostRets = 0; // Matched nothing.
+    uint64_t unmatchedCalls = 0; // Written out.
+    uint64_t maxPending = 0; // Calls waiting, as the main thread saw it.
+    uint64_t batches = 0;
+    uint64_t filtered = 0; // Calls and rets --include and --exclude dropped.
+    uint64_t stolen = 0; // Chunks classified for another thread.
+    uint64_t spilled = 0; // Calls --max-mem sent to disk.
 
-    /* Process the payload*/
-    bool operator()(const std::string& Ret) const
+    /* Seconds. */
+    double readTime = 0;
+    double classifyTime = 0; // Cutting, classifying and parsing lines.
+    double matchTime = 0;
+    double outputTime = 0;
+    double waitTime = 0; // Blocked on another thread.
+
+    void add(const Stats& o)
     {
-        /* Check the call match. This "cleaning" could be done in the
-        constructor, but I put it here. As the performance bottleneck
-        is expected to be all in this method. */
-        auto callPosBegin = Call.find("Call ") + 5;
-        auto callPosEnd = Call.find_first_of('(') - callPosBegin;
-        std::string funcCall = Call.substr(callPosBegin, callPosEnd);
+        bytes += o.bytes;
+        lines += o.lines;
+        calls += o.calls;
+        rets += o.rets;
+        fastMatches += o.fastMatches;
+        fallbackMatches += o.fallbackMatches;
+        lostRets += o.lostRets;
+        unmatchedCalls += o.unmatchedCalls;
+        maxPending = std::max(maxPending, o.maxPending);
+        batches += o.batches;
+        filtered += o.filtered;
+        stolen += o.stolen;
+        spilled += o.spilled;
+        readTime += o.readTime;
+        classifyTime += o.classifyTime;
+        matchTime += o.matchTime;
+        outputTime += o.outputTime;
+        waitTime += o.waitTime;
+    }
+};
 
-        /* Do we match the "ret"urn? This is the single most expensive
-        operation of the entire software! */
-        if (Ret.find(funcCall) == std::string::npos)
-            return false;
+/* Adds the time until it goes out of scope to a stage. */
+struct StageTimer {
+    StageTimer(double& t) : total(t), running(timeStages)
+    {
+        if (running)
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~StageTimer()
+    {
+        if (running)
+            total += secondsSince(start);
+    }
 
-        /* Check return address, if it exists. */
-        auto addrPosBegin = Call.find("ret=");
+    double& total;
+    bool running;
+    std::chrono::steady_clock::time_point start;
+};
 
-        /* There was no return address, assume we match the string.
-        Another expensive operation, but not so bad. */
-        if (addrPosBegin == std::string::npos)
-            return true;
+/* A piece of the input. This is what std::string_view would be, but we are
+C++11. It doesn't own anything, so it is only good as long as what it points
+to is. */
+struct Slice {
+    static const size_t npos = ~size_t(0);
 
-        addrPosBegin += 4;
-        std::string addr = Call.substr(addrPosBegin); // Get the return address.
+    Slice() {}
+    Slice(const char* d, size_t n) : data(d), size(n) {}
+    Slice(const std::string& s) : data(s.data()), size(s.size()) {}
 
-        /* Do we also match the address? Another expensive operation. */
-        if (Ret.find(addr) == std::string::npos)
-            return false;
+    bool empty() const { return size == 0; }
+    char operator[](size_t i) const { return data[i]; }
+    std::string str() const { return std::string(data, size); }
 
-        return true;
+    bool operator==(const Slice& s) const
+    {
+        return size == s.size && std::memcmp(data, s.data, size) == 0;
+    }
+
+    Slice substr(size_t pos, size_t n = npos) const
+    {
+        return Slice(data + pos, std::min(n, size - pos));
+    }
+
+    /* Same as their std::string counterparts. */
+    size_t find(const char* s, size_t pos = 0) const
+    {
+        auto n = std::strlen(s);
+        auto it = std::search(data + pos, data + size, s, s + n);
+        return it == data + size ? npos : it - data;
+    }
+
+    size_t rfind(const char* s) const
+    {
+        auto n = std::strlen(s);
+        auto it = std::find_end(data, data + size, s, s + n);
+        return it == data + size ? npos : it - data;
+    }
+
+    size_t findFirstOf(char c, size_t pos = 0) const
+    {
+        if (pos >= size)
+            return npos;
+        auto p = static_cast<const char*>(std::memchr(data + pos, c, size - pos));
+        return p ? p - data : npos;
+    }
+
+    size_t findFirstNotOf(char c, size_t pos = 0) const
+    {
+        for (; pos < size; ++pos)
+            if (data[pos] != c)
+                return pos;
+        return npos;
     }
 
-    std::string Call;
+    const char* data = nullptr;
+    size_t size = 0;
 };
 
-/* The actual thread. This guy contains a vector of work functors. Here we are
-parsing strings. I couldn't use a vector of std::function as I need to store
-a parameter inside, and later process that. A function object seemed
-more appropriate. */
-struct Thread {
-    /* WARING: If you have other member assignements, the thread
-    construction would be in another method, and called AFTER the
-    constructor. Remember that constructor initialization order is NOT
-    guaranteed! */
-    Thread() { myThread = std::thread(&Thread::run, this); }
+/* Write a slice, without any copies. */
+std::ostream& operator<<(std::ostream& os, const Slice& s)
+{
+    return os.write(s.data, s.size);
+}
 
-    /* If this is called before the thread is done, your software will hang. */
-    ~Thread() { myThread.join(); }
+/* Where the lines come from. getline() on an ifstream allocated a string per
+line, which was a major performance hit on multi GB logs. Readers hand out
+blocks of whole lines instead, the line scanner cuts them up. */
+struct InputReader {
+    static const size_t blockSize = 1 << 20;
+
+    virtual ~InputReader() {}
+
+    /* Get the next block of whole lines, newlines included. Only the last
+    block of the input may end without one. Returns false at the end of the
+    input. */
+    virtual bool getBlock(Slice& block) = 0;
+
+    /* True if the blocks we hand out stay valid for the life of the reader.
+    If not, they are only good until the next getBlock() and lines have to
+    be copied to be kept around. */
+    virtual bool stable() const = 0;
 
-    /* Our final output method. We lock_guard on an internal mutex in case
-    things went bad and the thread hasn't finished working. More than likely
-    processing it's "last run". */
-    friend std::ostream& operator<<(std::ostream& os, Thread& t)
+    /* The whole input, if it is mapped. Offsets are relative to this. */
+    virtual const char* mapping() const { return nullptr; }
+
+    /* True if the input ended early, on an error. The blocks we handed out
+    are all we got of it, the output is cut short too. */
+    virtual bool failed() const { return false; }
+
+    /* The byte offset of the next block. */
+    uint64_t offset() const { return pos; }
+
+    uint64_t pos = 0;
+};
+
+/* The fast path. The whole file is mapped, lines point straight into the
+mapping and the kernel takes care of the readahead. Mostly: it reads ahead
+128 KB at a time, a page fault at a time, and the workers stall on every
+one of them. We ask for a window well ahead of the blocks we hand out
+instead, a step at a time as we get closer. */
+struct MappedReader : InputReader {
+    static const size_t readahead = 16 << 20;
+    static const size_t readaheadStep = 4 << 20;
+
+    MappedReader(const char* data, uint64_t size) : begin(data), end(data + size)
     {
-        std::lock_guard<std::mutex> lk(t.vectorMutex); // Don't explode.
-        os << t.parseVector[0].Call << std::endl; // Output remaining call.
-        t.parseVector.erase(t.parseVector.begin()); // Yes yes I know...
-        return os; // Never forget!
     }
 
-    /* This is our working state: wait till we are ready to work,
-    get notified we are, do work, rince repeat. Lock on an internal mutex
-    in case work is still getting queued up. */
-    void run()
+    ~MappedReader() { munmap(const_cast<char*>(begin), end - begin); }
+
+    bool getBlock(Slice& block) override
     {
-        while(running) {
-            /* Wait to be notified. */
-            std::unique_lock<std::mutex> lock(mutex);
-            /* Very simple conditon variable example. */
-            processCondition.wait(lock);
-
-            /* Vector is free? */
-            std::lock_guard<std::mutex> lk(vectorMutex);
-            for (int i = 0; i < parseVector.size(); ++i) {
-                /* The functor returns true if the call was
-                matched. */
-                if (parseVector[i](currentWork)) {
-                    /* I know. But data oriented design.
-                    Do some performance analysis and see how
-                    this really isn't a bottle-neck. */
-                    parseVector.erase(parseVector.begin() + i);
-                    /* We know that we only have to match 1
-                    call.
-                    TODO: We could notify other threads they
-                    are also done.*/
-                    break;
-                }
-            }
+        const char* p = begin + pos;
+        if (p >= end)
+            return false;
+
+        /* Cut roughly blockSize bytes, up to the end of that line. */
+        const char* blockEnd = end;
+        if (static_cast<size_t>(end - p) > blockSize) {
+            auto nl = static_cast<const char*>(std::memchr(p + blockSize, '\n',
+                    end - p - blockSize));
+            if (nl)
+                blockEnd = nl + 1;
+        }
+        block = Slice(p, blockEnd - p);
+        pos = blockEnd - begin;
+
+        /* The mapping is page aligned and so are the steps. */
+        uint64_t size = end - begin;
+        while (advised < size && advised < pos + readahead) {
+            uint64_t n = std::min<uint64_t>(readaheadStep, size - advised);
+            madvise(const_cast<char*>(begin + advised), n, MADV_WILLNEED);
+            advised += n;
         }
+        return true;
     }
 
-    /* Utility */
-    void stop()
+    /* Start at offset instead, a line boundary. The readahead starts there
+    too, from the page it is in. */
+    void seek(uint64_t offset)
     {
-        running = false;
+        pos = offset;
+        advised = offset / getpagesize() * getpagesize();
     }
 
-    /* Create a function object, move the call string in it. */
-    void addCall(std::string call)
+    bool stable() const override { return true; }
+    const char* mapping() const override { return begin; }
+
+    const char* begin;
+    const char* end;
+    uint64_t advised = 0; // Up to where we asked for readahead.
+};
+
+/* Pipes, fifos, stdin and whatever else can't be mapped. We read() big
+blocks and cut the lines out of them. */
+struct BufferedReader : InputReader {
+    BufferedReader(int f) : fd(f), buffer(blockSize) {}
+    ~BufferedReader() { close(fd); }
+
+    bool getBlock(Slice& block) override
     {
-        std::lock_guard<std::mutex> lk(vectorMutex); // Just in case.
-        parseVector.push_back(Parser(std::move(call)));
+        head = next; // The previous block is done with.
+        size_t searched = head;
+        while (true) {
+            /* Find the last newline we have. */
+            size_t end = tail;
+            while (end > searched && buffer[end - 1] != '\n')
+                --end;
+            if (end > searched) {
+                block = Slice(&buffer[head], end - head);
+                pos += block.size;
+                next = end;
+                return true;
+            }
+            searched = tail;
+
+            if (eof) {
+                /* Last line, without a newline. */
+                if (head == tail)
+                    return false;
+                block = Slice(&buffer[head], tail - head);
+                pos += block.size;
+                next = tail;
+                return true;
+            }
+
+            fill();
+            searched -= head;
+            head = 0;
+        }
     }
 
-    /* The string to process is copied inside the thread. */
-    void processLine(std::string line)
+    bool stable() const override { return false; }
+
+    /* What was already read from fd before us. */
+    void preload(const Slice& s)
     {
-        currentWork = line;
+        std::memcpy(&buffer[0], s.data, s.size);
+        tail = s.size;
     }
 
-    /* Utility */
-    int size()
+    /* Move what is left of the current line to the front, and read as much
+    as we can behind it. Lines longer than the buffer make it grow. */
+    void fill()
     {
-        return parseVector.size();
+        std::memmove(&buffer[0], &buffer[head], tail - head);
+        tail -= head;
+        if (tail == buffer.size())
+            buffer.resize(buffer.size() * 2);
+
+        ssize_t n = readSome(&buffer[tail], buffer.size() - tail);
+        if (n < 0 && !error) {
+            /* EIO, ESTALE on NFS. What we have is all we get, but it is
+            not the end of the log. */
+            error = errno;
+            *status << "Couldn't read the input: " << std::strerror(error)
+                    << std::endl;
+        }
+        if (n <= 0)
+            eof = true;
+        else
+            tail += n;
     }
 
-    bool running = true; // We start running.
-    std::string currentWork; // The copied string to process.
-    std::thread myThread; // Our thread.
-    std::mutex vectorMutex; // Inner mutex to prevent explosions.
+    bool failed() const override { return error != 0; }
+
+    /* Up to size bytes of the input, 0 at the end of it, or -1. */
+    virtual ssize_t readSome(char* p, size_t size)
+    {
+        ssize_t n;
+        do {
+            n = read(fd, p, size);
+        } while (n < 0 && errno == EINTR);
+        return n;
+    }
 
-    /* We store the functors contiguously in a vector, as this will REALLY
-    improve the performance. No Pointers Allowed. */
-    std::vector<Parser> parseVector;
+    int fd;
+    bool eof = false;
+    int error = 0; // The errno of the read that stopped us.
+    size_t head = 0; // Start of the current block.
+    size_t next = 0; // Start of the next block.
+    size_t tail = 0; // End of the data read so far.
+    std::vector<char> buffer;
 };
 
-/* This is the thread pool. It will contain as many threads as your processor
-supports - 1, since we also have the main thread.
-It uses a vector of the thread objects, will enqueue work to the thread that
-has the least work to do, and has a few utility methods like killAll and size.
-The output is tailored to this specific software, and should be rewritten if
-you use this. */
-struct ThreadPool {
-    ThreadPool()
-    {
-        /* Ask kingly how many threads the CPU supports. */
-        auto numThreads = std::thread::hardware_concurrency() - 1;
-        /* 0 is either an error or dual core. -1 single core (does that
-        still exist?) */
-        if (numThreads <= 0)
-            numThreads = 1;
-        /* Create the thread objects. Emplace them in the vector. */
-        for (auto i = 0; i < numThreads; ++i) {
-            pool.emplace_back(new Thread());
+#ifdef HAVE_IO_URING
+/* Regular files we don't map, --no-mmap. A read() stops us until its block
+is there, and the workers wait with us. Here we keep depth reads in flight
+ahead of the one we are on, a block each, and take them in order as they
+come in. The page cache stays in the loop, no O_DIRECT: logs are usually
+still warm from the run that wrote them. */
+struct UringReader : BufferedReader {
+    static const unsigned depth = 8;
+
+    /* A block of the file, and where it is in its read. */
+    struct Slot {
+        enum State { Idle, Reading, Ready };
+
+        std::vector<char> data;
+        struct iovec iov;
+        uint64_t at = 0;
+        size_t size = 0; // What we asked for.
+        ssize_t result = 0;
+        size_t used = 0; // Handed out so far.
+        State state = Idle;
+    };
+
+    UringReader(int f, uint64_t n) : BufferedReader(f), length(n) {}
+
+    ~UringReader()
+    {
+        /* The kernel may still be writing into our buffers. */
+        while (inFlight && wait()) {
         }
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (ring >= 0)
+            close(ring);
     }
 
-    /* Loop over the threads in a "horizontal" manner, assuming the work
-    was well balanced and is somewhat still in order.
-    FIXME: A better way of outputting sequentially would be to store the
-    line number, and output according to that. */
-    friend std::ostream& operator<<(std::ostream& os, ThreadPool& tp)
+    /* Set up the ring and start reading. False if we can't have io_uring,
+    old kernels or seccomp, then the plain read() will do. */
+    bool start()
     {
-        int i = 0;
-        while (!tp.pool.empty()) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring = syscall(__NR_io_uring_setup, depth, &params);
+        if (ring < 0)
+            return false;
 
-            /* This will unlock the thread, more info below. */
-            if (tp.pool[i]->size() == 0) {
-                i = tp.killThread(i);
-                continue;
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes
+                + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return false;
+        cqRing = params.features & IORING_FEAT_SINGLE_MMAP ? sqRing
+                : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+        if (cqRing == MAP_FAILED || sqes == MAP_FAILED)
+            return false;
+
+        char* sq = static_cast<char*>(sqRing);
+        char* cq = static_cast<char*>(cqRing);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        for (unsigned i = 0; i < depth; ++i) {
+            slots[i].data.resize(blockSize);
+            submit(i);
+        }
+        return enter(0);
+    }
+
+    ssize_t readSome(char* p, size_t size) override
+    {
+        while (true) {
+            Slot& s = slots[current];
+            if (s.state == Slot::Idle)
+                return 0; // Past the end of the file.
+            while (s.state == Slot::Reading) {
+                if (!wait())
+                    return -1;
             }
+            if (s.result < 0) {
+                errno = -s.result;
+                return -1;
+            }
+            if (s.used < static_cast<size_t>(s.result)) {
+                size_t n = std::min(size, s.result - s.used);
+                std::memcpy(p, &s.data[s.used], n);
+                s.used += n;
+                return n;
+            }
+            if (!s.result)
+                return 0; // The file got shorter.
 
-            os << *(tp.pool[i]); // Print to file.
-            i = (i + 1) % tp.pool.size(); // Loop de loop.
+            /* This one is done, on to the next block of the file. */
+            submit(current);
+            if (slots[current].state == Slot::Reading && !enter(0))
+                return -1;
+            current = (current + 1) % depth;
         }
-        return os; // Never forget!
     }
 
-    /* This was a major problem. The threads were stuck waiting on their
-    mutexes and the condition variable. So here we need to first, switch
-    the running bool to stop, then unlock all the mutexes so the thread
-    completes its "infinit" work loop. */
-    int killThread(const int& i)
+    /* Queue a read of the next block into slot i, if there is one. */
+    void submit(unsigned i)
     {
-        pool[i]->stop(); // Notify the thread it is done, pat on back.
-        processCondition.notify_all(); // Triggers the conditional var.
-        pool.erase(pool.begin() + i); // Remove the pool from our vector.
-        return i < pool.size() ? i : 0; // Return the next thread.
+        Slot& s = slots[i];
+        s.result = 0;
+        s.used = 0;
+        if (readAt >= length) {
+            s.state = Slot::Idle;
+            return;
+        }
+        s.at = readAt;
+        s.size = std::min<uint64_t>(s.data.size(), length - readAt);
+        s.iov.iov_base = &s.data[0];
+        s.iov.iov_len = s.size;
+        s.state = Slot::Reading;
+        readAt += s.size;
+
+        unsigned sqEnd = *sqTail;
+        unsigned index = sqEnd & sqMask;
+        io_uring_sqe& sqe = reinterpret_cast<io_uring_sqe*>(sqes)[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READV;
+        sqe.fd = fd;
+        sqe.off = s.at;
+        sqe.addr = reinterpret_cast<uint64_t>(&s.iov);
+        sqe.len = 1;
+        sqe.user_data = i;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, sqEnd + 1, __ATOMIC_RELEASE);
+        ++queued;
+        ++inFlight;
     }
 
-    /* Utility method to kill all the threads. Unused. */
-    void killAll()
+    /* Hand the kernel what we queued, and wait for at least minComplete
+    reads to be done. */
+    bool enter(unsigned minComplete)
     {
-        for (const auto& x : pool) {
-            x->stop();
+        while (true) {
+            long r = syscall(__NR_io_uring_enter, ring, queued, minComplete,
+                    minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (r >= 0) {
+                queued -= r;
+                return true;
+            }
+            if (errno != EINTR)
+                return false;
         }
-        processCondition.notify_all();
     }
 
-    /* This is where we add work. We will check which thread has the least
-    amount of work to distribute the work-load. */
-    void enqueue(std::string call)
+    /* Wait for the next read to be done, and note whatever is. */
+    bool wait()
     {
-        /* next points to the least busy thread. */
-        auto next = std::min_element(pool.begin(), pool.end(),
-        [](const std::unique_ptr<Thread>& i,
-            const std::unique_ptr<Thread>& j)
-            { return i->size() < j->size(); });
+        unsigned seen = *cqHead;
+        if (seen == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) && !enter(1))
+            return false;
+
+        unsigned done = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; seen != done; ++seen) {
+            const io_uring_cqe& cqe = cqes[seen & cqMask];
+            Slot& s = slots[cqe.user_data];
+            s.result = cqe.res;
+            s.state = Slot::Ready;
+            --inFlight;
+
+            /* Short reads happen, get the rest the plain way. */
+            ssize_t r = 1;
+            while (s.result > 0 && static_cast<size_t>(s.result) < s.size
+                    && r > 0) {
+                r = pread(fd, &s.data[s.result], s.size - s.result,
+                        s.at + s.result);
+                if (r > 0)
+                    s.result += r;
+                else if (r < 0 && errno == EINTR)
+                    r = 1;
+                else if (r < 0)
+                    s.result = -errno; // Not a hole in the output.
+            }
+        }
+        __atomic_store_n(cqHead, done, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    uint64_t length; // Of the file, what we read up to.
+    uint64_t readAt = 0; // The file offset of the next read.
+    unsigned current = 0; // The slot we hand out from.
+    unsigned queued = 0; // Submitted to the ring, not to the kernel yet.
+    unsigned inFlight = 0;
+    Slot slots[depth];
+
+    int ring = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    void* sqes = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    size_t sqesSize = 0;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+};
+#endif
+
+/* The compressed formats we know, by the magic bytes they start with. The
+tools are what we fall back on when we weren't built with the library, they
+all take -d -c -q. */
+struct Format {
+    const char* name; // Also the tool.
+    const char* magic;
+    size_t magicSize;
+    const char* extension;
+};
+
+const Format formats[] = {
+    {"gzip", "\x1f\x8b", 2, ".gz"},
+    {"xz", "\xfd" "7zXZ\0", 6, ".xz"},
+    {"zstd", "\x28\xb5\x2f\xfd", 4, ".zst"},
+};
+
+const size_t maxMagic = 6;
+
+/* The format of a file starting with prefix, or nullptr if it is plain. */
+const Format* sniffFormat(const Slice& prefix)
+{
+    for (const auto& format : formats) {
+        if (prefix.size >= format.magicSize
+                && !std::memcmp(prefix.data, format.magic, format.magicSize))
+            return &format;
+    }
+    return nullptr;
+}
+
+/* write() all of it, the pipes take it in pieces. */
+bool writeAll(int fd, const char* p, size_t n)
+{
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+/* A pipe, whose ends don't leak into the tools we start. */
+bool makePipe(int p[2])
+{
+    if (pipe(p) != 0)
+        return false;
+    fcntl(p[0], F_SETFD, FD_CLOEXEC);
+    fcntl(p[1], F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+/* Run a tool with in and out as its stdin and stdout. Only async signal
+safe calls in the child, we have threads. */
+pid_t spawn(const char* const argv[], int in, int out)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        execvp(argv[0], const_cast<char* const*>(argv));
+        _exit(127);
+    }
+    return pid;
+}
 
-        (**next).addCall(std::move(call)); // Add work.
+/* Wait for a tool, true if it went well. */
+bool reap(pid_t pid)
+{
+    int st;
+    while (waitpid(pid, &st, 0) < 0) {
+        if (errno != EINTR)
+            return false;
     }
+    return WIFEXITED(st) && WEXITSTATUS(st) == 0;
+}
 
-    /* Notify all threads they can process their queued up work. This
-    effectivily unlocks their mutexes (once) using a conditional variable.
-    We lock_guard in case the threads are still working. */
-    void process(std::string line)
+/* Turns compressed bytes into the log, written to out. Closing out when we
+are gone is how the reader learns the log is over. */
+struct Decoder {
+    static const size_t bufferSize = 1 << 20;
+
+    Decoder(int o) : out(o) {}
+    virtual ~Decoder() { if (out >= 0) close(out); }
+
+    virtual bool decode(const char* data, size_t size) = 0;
+
+    /* The input is over. False if it ended in the middle of something. */
+    virtual bool finish() = 0;
+
+    int out;
+};
+
+/* No library, the tool decompresses in a process of its own. We feed it,
+it writes straight into the reader's pipe. */
+struct ToolDecoder : Decoder {
+    ToolDecoder(const char* tool, int o) : Decoder(o)
     {
-        std::lock_guard<std::mutex> lock(mutex); // Threads aren't ready.
-        for (const auto& x : pool) {
-            x->processLine(line); // Line is NOT moved.
+        const char* argv[] = {tool, "-d", "-c", "-q", nullptr};
+        int p[2];
+        if (makePipe(p)) {
+            pid = spawn(argv, p[0], out);
+            close(p[0]);
+            in = p[1];
         }
-        processCondition.notify_all(); // Get to work!
+        close(out); // It's the tool's now.
+        out = -1;
     }
 
-    /* Utility, how many objects are queued for work. */
-    int size()
+    ~ToolDecoder()
     {
-        int ret = 0;
-        for (const auto& x : pool) {
-            ret += x->size();
+        if (in >= 0)
+            close(in);
+        if (pid > 0)
+            reap(pid);
+    }
+
+    bool decode(const char* data, size_t size) override
+    {
+        return pid > 0 && writeAll(in, data, size);
+    }
+
+    bool finish() override
+    {
+        close(in);
+        in = -1;
+        bool ok = pid > 0 && reap(pid);
+        pid = -1;
+        return ok;
+    }
+
+    pid_t pid = -1;
+    int in = -1; // The tool's stdin.
+};
+
+#ifdef WITH_ZLIB
+struct ZlibDecoder : Decoder {
+    ZlibDecoder(int o) : Decoder(o), buffer(bufferSize)
+    {
+        std::memset(&z, 0, sizeof(z));
+        inflateInit2(&z, 15 + 32); // gzip header.
+    }
+
+    ~ZlibDecoder() { inflateEnd(&z); }
+
+    bool decode(const char* data, size_t size) override
+    {
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        z.avail_in = size;
+        do {
+            z.next_out = reinterpret_cast<Bytef*>(&buffer[0]);
+            z.avail_out = buffer.size();
+            int r = inflate(&z, Z_NO_FLUSH);
+            if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+                return false;
+            if (!writeAll(out, &buffer[0], buffer.size() - z.avail_out))
+                return false;
+            ended = r == Z_STREAM_END;
+            if (ended)
+                inflateReset(&z); // gzip files can be concatenated.
+        } while (z.avail_in || !z.avail_out);
+        return true;
+    }
+
+    bool finish() override { return ended; }
+
+    z_stream z;
+    bool ended = false;
+    std::vector<char> buffer;
+};
+#endif
+
+#ifdef WITH_LZMA
+struct LzmaDecoder : Decoder {
+    LzmaDecoder(int o) : Decoder(o), buffer(bufferSize)
+    {
+        ok = lzma_stream_decoder(&s, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+    }
+
+    ~LzmaDecoder() { lzma_end(&s); }
+
+    bool decode(const char* data, size_t size) override
+    {
+        return ok && code(data, size, LZMA_RUN);
+    }
+
+    bool finish() override { return ok && code(nullptr, 0, LZMA_FINISH); }
+
+    bool code(const char* data, size_t size, lzma_action action)
+    {
+        s.next_in = reinterpret_cast<const uint8_t*>(data);
+        s.avail_in = size;
+        while (true) {
+            s.next_out = reinterpret_cast<uint8_t*>(&buffer[0]);
+            s.avail_out = buffer.size();
+            lzma_ret r = lzma_code(&s, action);
+            if (!writeAll(out, &buffer[0], buffer.size() - s.avail_out))
+                return false;
+            if (r == LZMA_STREAM_END)
+                return true;
+            if (r != LZMA_OK)
+                return false;
+            if (action == LZMA_RUN && !s.avail_in && s.avail_out)
+                return true;
         }
-        return ret;
     }
 
-    /* We use unique_ptr because there where major move semantics issues.
-    Since the only real work in the thread pool is figuring out which thread
-    is available, memory data alignement is not as important. */
-    std::vector<std::unique_ptr<Thread>> pool;
+    lzma_stream s = LZMA_STREAM_INIT;
+    bool ok;
+    std::vector<char> buffer;
 };
+#endif
 
-/* Our main software, we will:
-Open the input file, create the output file.
-Read the input file, create functor parser objects.
-Notify the threadpool that when a new line is ready for parsing.
-Print a progress bar.
-Finally output the remaining parser objects in the output file.
-Close the open files.
-...
-profit */
-int main(int argc, char** argv)
-{
-    /* Print Help */
-    if (argc <= 1 || argc > 2) {
-        std::cout << help << std::endl;
-        return 0;
+#ifdef WITH_ZSTD
+struct ZstdDecoder : Decoder {
+    ZstdDecoder(int o) : Decoder(o), stream(ZSTD_createDStream()),
+        buffer(ZSTD_DStreamOutSize())
+    {
+        ZSTD_initDStream(stream);
     }
 
-    /* Initialize */
-    std::string filename = std::string(argv[1]); // Filename is first argument.
-    std::ifstream inFile = openInFile(filename); // Open input log.
-    std::ofstream outFile = openOutFile(filename); // Open output file for writing.
+    ~ZstdDecoder() { ZSTD_freeDStream(stream); }
 
-    /* Create the ThreadPool object. This contains our threads (on my
-    laptop 7 threads), and takes care of distributing the work load. */
-    ThreadPool workerPool;
+    bool decode(const char* data, size_t size) override
+    {
+        ZSTD_inBuffer in = {data, size, 0};
+        do {
+            ZSTD_outBuffer o = {&buffer[0], buffer.size(), 0};
+            left = ZSTD_decompressStream(stream, &o, &in);
+            if (ZSTD_isError(left) || !writeAll(out, &buffer[0], o.pos))
+                return false;
+            if (o.pos < o.size && in.pos == in.size)
+                break;
+        } while (true);
+        return true;
+    }
 
+    bool finish() override { return !left; }
 
-    /* This string is allocated for every line. It is a major performance
-    hit. */
-    std::string line;
+    ZSTD_DStream* stream;
+    size_t left = 0; // Not 0 in the middle of a frame.
+    std::vector<char> buffer;
+};
+#endif
 
-    /* Read input file, queue the calls, process the rets or add to
-    finale output. */
-    while (getline(inFile, line)) {
-        /* The line is a Call. This is a future work object. Add it to
-        the thread pool to be eventually processed. */
-        if (line.find("Call") != std::string::npos) {
-            workerPool.enqueue(std::move(line));
-
-        /* The line is a ret. Process the stored calls to match the
-        return line. This will trigger the work (our condition variable). */
-        } else if (line.find("Ret") != std::string::npos) {
-            workerPool.process(std::move(line));
-
-        /* This is not a line we can parse. Add it to the output log.
-        TODO: To make this sofware really useful, we should store the
-        line numbers and output the final result "in sequence". */
-        } else {
-            outFile << line << std::endl;
+/* The library for a format if we have it, or its tool. */
+std::unique_ptr<Decoder> makeDecoder(const Format& format, int out)
+{
+    std::string name = format.name;
+#ifdef WITH_ZLIB
+    if (name == "gzip")
+        return std::unique_ptr<Decoder>(new ZlibDecoder(out));
+#endif
+#ifdef WITH_LZMA
+    if (name == "xz")
+        return std::unique_ptr<Decoder>(new LzmaDecoder(out));
+#endif
+#ifdef WITH_ZSTD
+    if (name == "zstd")
+        return std::unique_ptr<Decoder>(new ZstdDecoder(out));
+#endif
+    return std::unique_ptr<Decoder>(new ToolDecoder(format.name, out));
+}
+
+/* Compressed input. A thread of its own decompresses into a pipe, and we
+read the log from the other end like from any other pipe. So decompressing
+runs next to the parsing, and the pipe keeps the two in step. */
+struct CompressedReader : BufferedReader {
+    /* Start decompressing in, prefix is what was already read of it. */
+    CompressedReader(int in, const Slice& prefix, const Format& format)
+        : BufferedReader(-1)
+    {
+        int p[2];
+        if (!makePipe(p)) {
+            close(in);
+            broken = true;
+            eof = true;
+            return;
         }
-        /* The nifty progress bar by Ross Hemsley. We divide the postion
-        by 100 since the files are so big, we weren't hitting the
-        update treshold enough. */
-        progressBar((inFile.tellg()/100) + 1, fileSize/100);
+        fd = p[0];
+#ifdef F_SETPIPE_SZ
+        fcntl(p[1], F_SETPIPE_SZ, 1 << 20); // Fewer wake ups, if we may.
+#endif
+        decoder = makeDecoder(format, p[1]);
+        worker = std::thread(&CompressedReader::run, this, in, prefix.str());
     }
 
-    /* Finalize */
-    std::cout << std::endl << "Lines left: " << workerPool.size()
-        << " -- Outputting to file." << std::endl; // Alert user.
+    ~CompressedReader()
+    {
+        /* If we stop early, the thread gets EPIPE instead of blocking. */
+        close(fd);
+        fd = -1;
+        if (worker.joinable())
+            worker.join();
+    }
 
-    /* Write all the remaining work to the output file. These are the
-    "calls" that weren't matched with "ret"urns. */
-    outFile << workerPool;
+    bool getBlock(Slice& block) override
+    {
+        if (BufferedReader::getBlock(block))
+            return true;
+        if (worker.joinable())
+            worker.join();
+        if (broken)
+            *status << "Couldn't decompress the input, it is cut short."
+                    << std::endl;
+        return false;
+    }
 
-    /* Cleanup */
-    inFile.close();
-    outFile.close();
-    return 0;
+    /* Only once getBlock() returned false. */
+    bool failed() const override
+    {
+        return broken || BufferedReader::failed();
+    }
+
+    void run(int in, std::string prefix)
+    {
+        /* A write to a pipe we closed has to fail, not kill us. */
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+        bool ok = decoder->decode(prefix.data(), prefix.size());
+        std::vector<char> buffer(Decoder::bufferSize);
+        while (ok) {
+            ssize_t n = read(in, &buffer[0], buffer.size());
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                ok = n == 0 && decoder->finish();
+                break;
+            }
+            ok = decoder->decode(&buffer[0], n);
+        }
+        close(in);
+        broken = !ok;
+        decoder.reset(); // Closes the pipe, the reader sees the end.
+    }
+
+    std::unique_ptr<Decoder> decoder;
+    bool broken = false; // Only read after the join.
+    std::thread worker;
+};
+
+/* Where the output goes. Every line used to go out with std::endl, which
+flushes the stream: a syscall per line. We gather the lines instead, and
+write them with writev() in one go once we have enough. Lines of a mapped
+input are handed over where they are, without a copy, with the newline
+behind them in the mapping. Neighbours in the mapping are one piece. Lines
+from anywhere else are copied into our buffer. */
+struct OutputSink {
+    static const size_t bufferSize = 1 << 20;
+    static const size_t maxPieces = 1024; // IOV_MAX about everywhere.
+    static const size_t maxPending = 8 << 20; // Don't sit on the output.
+
+    OutputSink(int f) : fd(f), buffer(bufferSize) {}
+
+    /* finish() first, we can't call send() here anymore. */
+    virtual ~OutputSink()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    /* The input, if it is mapped. Lines in there aren't copied. */
+    void setMapping(const char* data, uint64_t size)
+    {
+        mapping = Slice(data, size);
+    }
+
+    /* Write a line, we add the newline. */
+    void line(const Slice& s)
+    {
+        const char* end = mapping.data + mapping.size;
+        if (s.data >= mapping.data && s.data + s.size < end
+                && s.data[s.size] == '\n') {
+            add(s.data, s.size + 1);
+        } else if (s.size + 1 > buffer.size() - used) {
+            /* A giant line that won't fit, or a full buffer. */
+            flush();
+            if (s.size + 1 > buffer.size()) {
+                add(s.data, s.size);
+                add("\n", 1);
+                flush();
+                return;
+            }
+            line(s);
+            return;
+        } else {
+            /* add() can't be the one to flush, that would free where the
+            copy is before it goes out. */
+            if (pieces.size() == maxPieces)
+                flush();
+            char* p = &buffer[used];
+            std::memcpy(p, s.data, s.size);
+            p[s.size] = '\n';
+            used += s.size + 1;
+            add(p, s.size + 1);
+        }
+        if (pending >= maxPending)
+            flush();
+    }
+
+    /* Write everything we gathered. */
+    bool flush()
+    {
+        if (!pieces.empty() && ok && !send(&pieces[0], pieces.size())) {
+            *status << "Couldn't write the output." << std::endl;
+            ok = false;
+        }
+        pieces.clear();
+        used = 0;
+        pending = 0;
+        return ok;
+    }
+
+    /* Flush, and make sure it is all out. False if something went wrong. */
+    virtual bool finish() { return flush(); }
+
+    /* Hand the pieces to the kernel. */
+    virtual bool send(struct iovec* iov, size_t n)
+    {
+        while (n) {
+            int count = static_cast<int>(std::min(n, maxPieces));
+            ssize_t w = writev(fd, iov, count);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return false;
+
+            /* Skip what was written, it may stop in the middle of a piece. */
+            size_t written = w;
+            while (n && written >= iov->iov_len) {
+                written -= iov->iov_len;
+                ++iov;
+                --n;
+            }
+            if (n) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+                iov->iov_len -= written;
+            }
+        }
+        return true;
+    }
+
+    void add(const char* p, size_t n)
+    {
+        pending += n;
+        if (!pieces.empty()) {
+            struct iovec& last = pieces.back();
+            if (static_cast<char*>(last.iov_base) + last.iov_len == p) {
+                last.iov_len += n;
+                return;
+            }
+        }
+        if (pieces.size() == maxPieces)
+            flush();
+        struct iovec piece = {const_cast<char*>(p), n};
+        pieces.push_back(piece);
+    }
+
+    int fd;
+    bool ok = true;
+    Slice mapping;
+    std::vector<struct iovec> pieces;
+    std::vector<char> buffer; // The copies, it never grows.
+    size_t used = 0; // Of buffer.
+    size_t pending = 0; // Bytes gathered.
+};
+
+/* The output, compressed with zstd on the way. With libzstd we do it here,
+or the zstd tool does it in a process of its own and we write to it. */
+struct ZstdSink : OutputSink {
+    ZstdSink(int f) : OutputSink(f)
+    {
+#ifdef WITH_ZSTD
+        stream = ZSTD_createCStream();
+        ZSTD_initCStream(stream, 3);
+        packed.resize(ZSTD_CStreamOutSize());
+#else
+        const char* argv[] = {"zstd", "-c", "-q", nullptr};
+        int p[2];
+        if (makePipe(p)) {
+            pid = spawn(argv, p[0], fd);
+            close(p[0]);
+        }
+        close(fd);
+        fd = pid > 0 ? p[1] : -1;
+#endif
+    }
+
+#ifdef WITH_ZSTD
+    ~ZstdSink() { ZSTD_freeCStream(stream); }
+
+    bool send(struct iovec* iov, size_t n) override
+    {
+        for (size_t i = 0; i < n; ++i) {
+            ZSTD_inBuffer in = {iov[i].iov_base, iov[i].iov_len, 0};
+            while (in.pos < in.size) {
+                ZSTD_outBuffer o = {&packed[0], packed.size(), 0};
+                if (ZSTD_isError(ZSTD_compressStream(stream, &o, &in))
+                        || !writeAll(fd, &packed[0], o.pos))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    bool finish() override
+    {
+        if (!flush())
+            return false;
+        size_t left;
+        do {
+            ZSTD_outBuffer o = {&packed[0], packed.size(), 0};
+            left = ZSTD_endStream(stream, &o);
+            if (ZSTD_isError(left) || !writeAll(fd, &packed[0], o.pos)) {
+                *status << "Couldn't write the output." << std::endl;
+                return ok = false;
+            }
+        } while (left);
+        return true;
+    }
+
+    ZSTD_CStream* stream;
+    std::vector<char> packed;
+#else
+    bool send(struct iovec* iov, size_t n) override
+    {
+        return fd >= 0 && OutputSink::send(iov, n);
+    }
+
+    /* The tool is done once it saw the end of its input. */
+    bool finish() override
+    {
+        bool flushed = flush();
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+        if (pid > 0 && !reap(pid) && flushed) {
+            *status << "Couldn't write the output." << std::endl;
+            ok = false;
+        }
+        pid = -1;
+        return ok;
+    }
+
+    pid_t pid = -1;
+#endif
+};
+
+/* A simple function to open the read file. Regular files are mapped,
+everything else is read, or everything if map is false. Compressed input is
+decompressed on the fly. */
+std::unique_ptr<InputReader> openInFile(std::string f, bool map = true)
+{
+    std::unique_ptr<InputReader> inFile;
+
+    /* - is stdin. It may still be a file, "parsewinelog - < log.txt". */
+    int fd = f == "-" ? dup(STDIN_FILENO) : open(f.c_str(), O_RDONLY);
+    if (f == "-")
+        f = "stdin";
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        *status << "Couldn't read input file: " << f << std::endl;
+        if (fd >= 0)
+            close(fd);
+        return inFile;
+    }
+
+    /* Look at the magic bytes. We can't look at a pipe without reading it,
+    what we read is our prefix. */
+    char magic[maxMagic];
+    ssize_t n = 0;
+    if (S_ISREG(st.st_mode)) {
+        n = pread(fd, magic, maxMagic, 0);
+    } else {
+        ssize_t r;
+        while (n < static_cast<ssize_t>(maxMagic)
+                && ((r = read(fd, magic + n, maxMagic - n)) > 0
+                        || (r < 0 && errno == EINTR)))
+            n += std::max<ssize_t>(r, 0);
+    }
+    Slice prefix(magic, std::max<ssize_t>(n, 0));
+
+    if (const Format* format = sniffFormat(prefix)) {
+        if (S_ISREG(st.st_mode))
+            prefix = Slice(); // Not read yet.
+        fileSize = 0; // We don't know how big the log is.
+        *status << "Parsing: " << f << " -- Filesize: unknown, "
+                << format->name << " compressed" << std::endl;
+        inFile.reset(new CompressedReader(fd, prefix, *format));
+        return inFile;
+    }
+
+    if (map && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            inFile.reset(new MappedReader(static_cast<const char*>(data),
+                    st.st_size));
+            close(fd); // The mapping keeps the file alive.
+        }
+    }
+
+    if (!inFile && S_ISREG(st.st_mode)) {
+        /* Read from the start to the end, the kernel may as well read
+        ahead further than it dares by default. */
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#ifdef HAVE_IO_URING
+        if (st.st_size > 0) {
+            std::unique_ptr<UringReader> reader(new UringReader(fd, st.st_size));
+            if (reader->start()) {
+                inFile = std::move(reader);
+            } else {
+                reader->fd = -1; // The plain reader gets it.
+            }
+        }
+#endif
+    }
+
+    if (!inFile) {
+        BufferedReader* reader = new BufferedReader(fd);
+        if (!S_ISREG(st.st_mode))
+            reader->preload(prefix);
+        inFile.reset(reader);
+    }
+
+    fileSize = S_ISREG(st.st_mode) ? st.st_size : 0;
+    *status << "Parsing: " << f << " -- Filesize: ";
+    if (S_ISREG(st.st_mode))
+        *status << fileSize/1000000 << " MB" << std::endl;
+    else
+        *status << "unknown" << std::endl;
+
+    return inFile;
+}
+
+/* The name of the output file. It is the input's with _parsed in front of
+the extension, or at the end if it has none. A compression extension doesn't
+count, the output is plain. Unless we are asked to compress it with zstd:
+then it gets .zst again. */
+std::string outputName(std::string f, bool zstd)
+{
+    for (const auto& format : formats) {
+        size_t n = std::strlen(format.extension);
+        if (f.size() > n && !f.compare(f.size() - n, n, format.extension)) {
+            f.resize(f.size() - n);
+            break;
+        }
+    }
+
+    auto extPos = f.find_last_of(".");
+    if (extPos == std::string::npos
+            || f.find('/', extPos) != std::string::npos)
+        extPos = f.size();
+    std::string extension = f.substr(extPos);
+    std::string outFilename = f.substr(0, extPos);
+    f = outFilename + "_parsed" + extension;
+    if (zstd)
+        f += ".zst";
+    return f;
+}
+
+/* A simple function to open the output file. We write it from scratch, or
+after the first keep bytes of it, --follow. */
+std::unique_ptr<OutputSink> openOutFile(std::string f, bool zstd,
+        uint64_t keep = 0)
+{
+    f = outputName(f, zstd);
+    std::unique_ptr<OutputSink> outFile;
+    int fd = open(f.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (keep ? 0 : O_TRUNC),
+            0666);
+    if (fd >= 0 && keep && (ftruncate(fd, keep) != 0
+            || lseek(fd, keep, SEEK_SET) < 0)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0)
+        outFile.reset(zstd ? new ZstdSink(fd) : new OutputSink(fd));
+
+    if (!outFile)
+        *status << "Couldn't create output file: " << f << std::endl;
+    return outFile;
+}
+
+/* Returns the value of a hex digit, or -1 if c isn't one. */
+static inline int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* The 4 bytes of a token, as one integer we can compare with a load. */
+static inline uint32_t tokenWord(const char* token)
+{
+    uint32_t word;
+    std::memcpy(&word, token, 4);
+    return word;
+}
+
+/* What a line of the log is to us. */
+enum LineKind : unsigned char {
+    OtherLine, // trace:, fixme:, err:... Goes straight to the output.
+    CallLine,
+    RetLine,
+};
+
+/* A line of the input, classified. */
+struct Line {
+    Slice text; // Without the newline.
+    uint64_t offset; // Byte offset in the input.
+    unsigned int threadId; // Wine thread id.
+    unsigned int token; // Where the Call or Ret token starts in text.
+    LineKind kind;
+    bool hasTime; // The log has +timestamp.
+    uint32_t time; // Wine's tick count, in milliseconds.
+};
+
+/* Every relay line starts with the Wine thread id, "0009:Call ...". Calls
+and returns nest strictly per thread, so this id is all we need to know which
+stack a line belongs to. Lines without the prefix all land on thread 0.
+Right behind the prefix is the token telling us what the line is, so we only
+look at those 4 bytes instead of searching the whole line. */
+static inline void classifyLine(Line& line)
+{
+    const char* p = line.text.data;
+    size_t n = line.text.size;
+
+    /* With +timestamp, Wine's tick count goes in front of it all, as
+    seconds with 3 decimals, padded to 3 digits: "  1.234:0009:Call". */
+    size_t token = 0;
+    line.hasTime = false;
+    line.time = 0;
+    size_t digits = 0;
+    while (digits < n && p[digits] == ' ')
+        ++digits;
+    size_t dot = digits;
+    uint32_t seconds = 0;
+    while (dot < n && p[dot] >= '0' && p[dot] <= '9')
+        seconds = seconds * 10 + (p[dot++] - '0');
+    if (dot > digits && dot + 4 < n && p[dot] == '.' && p[dot + 4] == ':'
+            && std::isdigit(static_cast<unsigned char>(p[dot + 1]))
+            && std::isdigit(static_cast<unsigned char>(p[dot + 2]))
+            && std::isdigit(static_cast<unsigned char>(p[dot + 3]))) {
+        line.hasTime = true;
+        line.time = seconds * 1000 + (p[dot + 1] - '0') * 100
+                + (p[dot + 2] - '0') * 10 + (p[dot + 3] - '0');
+        token = dot + 5;
+    }
+
+    /* Skip the hex "XXXX:" prefixes, the last one is the thread. */
+    unsigned int id = 0;
+    for (int group = 0; group < 2; ++group) {
+        unsigned int value = 0;
+        size_t i = token;
+        int d;
+        while (i < n && (d = hexDigit(p[i])) >= 0) {
+            value = (value << 4) | d;
+            ++i;
+        }
+        if (i == token || i >= n || p[i] != ':')
+            break;
+        id = value;
+        token = i + 1;
+    }
+
+    line.threadId = id;
+    line.token = token;
+    line.kind = OtherLine;
+    if (n - token < 5)
+        return;
+
+    uint32_t word;
+    std::memcpy(&word, p + token, 4);
+    if (word == tokenWord("Call") && p[token + 4] == ' ')
+        line.kind = CallLine;
+    else if (word == tokenWord("Ret "))
+        line.kind = RetLine;
+}
+
+/* The prefixes of a log's relay lines, they are the same on all of them.
+Old Wines and WINEDEBUG=-tid print none, "Call ...", the ones since the
+thread id, "0009:Call", +pid the process id before it, "0008:0009:Call", and
++timestamp the tick count in front of it all. */
+enum Dialect : unsigned char {
+    AnyDialect, // Don't know, classifyLine() looks for all of them.
+    PlainDialect,
+    ThreadDialect,
+    ProcessDialect,
+    TimedPlainDialect,
+    TimedThreadDialect,
+    TimedProcessDialect,
+    dialectCount,
+};
+
+static const char* dialectNames[dialectCount] = {"any", "plain", "tid",
+        "pid, tid", "timestamp", "timestamp, tid", "timestamp, pid, tid"};
+
+/* classifyLine() for one dialect, with what it prints known at compile
+time. Wine prints the ids with %04x and the ticks with %3u.%03u, so the
+fields are nearly always where we expect them, and we only check they are.
+Anything else, a wider id or a line that isn't a call or ret, goes to
+classifyLine(), so the lines come out exactly the same. */
+template <bool timestamp, int groups>
+static inline void classifyAs(Line& line)
+{
+    const char* p = line.text.data;
+    size_t n = line.text.size;
+    size_t token = 0;
+    line.hasTime = false;
+    line.time = 0;
+
+    auto digit = [](char c) { return c >= '0' && c <= '9'; };
+    if (timestamp) {
+        /* "  1.234:", " 12.345:" or "123.456:". */
+        if (n < 9 || p[3] != '.' || p[7] != ':' || !digit(p[2])
+                || (p[1] == ' ' ? p[0] != ' ' : !digit(p[1])
+                        || (p[0] != ' ' && !digit(p[0])))
+                || !digit(p[4]) || !digit(p[5]) || !digit(p[6]))
+            return classifyLine(line);
+        uint32_t seconds = p[2] - '0';
+        if (digit(p[1]))
+            seconds += 10 * (p[1] - '0');
+        if (digit(p[0]))
+            seconds += 100 * (p[0] - '0');
+        line.hasTime = true;
+        line.time = seconds * 1000 + (p[4] - '0') * 100 + (p[5] - '0') * 10
+                + (p[6] - '0');
+        token = 8;
+    }
+
+    unsigned int id = 0;
+    for (int group = 0; group < groups; ++group) {
+        int a, b, c, d;
+        if (n > token + 4 && p[token + 4] == ':' && (a = hexDigit(p[token])) >= 0
+                && (b = hexDigit(p[token + 1])) >= 0
+                && (c = hexDigit(p[token + 2])) >= 0
+                && (d = hexDigit(p[token + 3])) >= 0) {
+            id = a << 12 | b << 8 | c << 4 | d;
+            token += 5;
+        } else {
+            return classifyLine(line);
+        }
+    }
+
+    line.threadId = id;
+    line.token = token;
+    if (n - token >= 5) {
+        uint32_t word;
+        std::memcpy(&word, p + token, 4);
+        if (word == tokenWord("Call") && p[token + 4] == ' ') {
+            line.kind = CallLine;
+            return;
+        }
+        if (word == tokenWord("Ret ")) {
+            line.kind = RetLine;
+            return;
+        }
+    }
+    classifyLine(line);
+}
+
+typedef void (*LineClassifier)(Line&);
+
+/* Found a newline, the line is done. */
+template <LineClassifier classify>
+static inline void addLine(std::vector<Line>& lines, const Slice& block,
+        uint64_t offset, const char* begin, const char* end)
+{
+    Line line;
+    line.text = Slice(begin, end - begin);
+    line.offset = offset + (begin - block.data);
+    classify(line);
+    lines.push_back(line);
+}
+
+#if !defined(__SSE2__) && !defined(__aarch64__)
+/* The plain version, for CPUs we don't have vector code for. memchr is
+usually vectorized by the libc anyways. */
+template <LineClassifier classify>
+static void scanLinesScalar(const Slice& block, uint64_t offset,
+        std::vector<Line>& lines)
+{
+    const char* start = block.data;
+    const char* end = block.data + block.size;
+    while (start < end) {
+        auto nl = static_cast<const char*>(std::memchr(start, '\n', end - start));
+        addLine<classify>(lines, block, offset, start, nl ? nl : end);
+        start = nl ? nl + 1 : end;
+    }
+}
+#endif
+
+/* The vector scanners compare 64 bytes at a time against '\n' and give us a
+bit mask of the newlines. Then we only have to walk the set bits, classifying
+every line while its start is still in cache. */
+template <uint64_t (*newlineMask)(const char*), LineClassifier classify>
+static void scanLinesWith(const Slice& block, uint64_t offset,
+        std::vector<Line>& lines)
+{
+    const char* p = block.data;
+    const char* start = p;
+    const char* end = block.data + block.size;
+
+    for (; end - p >= 64; p += 64) {
+        for (uint64_t m = newlineMask(p); m; m &= m - 1) {
+            const char* nl = p + __builtin_ctzll(m);
+            addLine<classify>(lines, block, offset, start, nl);
+            start = nl + 1;
+        }
+    }
+
+    /* Less than 64 bytes left. */
+    for (; p < end; ++p) {
+        if (*p == '\n') {
+            addLine<classify>(lines, block, offset, start, p);
+            start = p + 1;
+        }
+    }
+
+    /* The last line of the input may not have a newline. */
+    if (start < end)
+        addLine<classify>(lines, block, offset, start, end);
+}
+
+#if defined(__SSE2__)
+static inline uint64_t sse2NewlineMask(const char* p)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t m = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+        uint64_t bits = static_cast<uint16_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+        m |= bits << (16 * i);
+    }
+    return m;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Compiled for AVX2 whatever the flags, only called if the CPU has it. */
+__attribute__((target("avx2")))
+static uint64_t avx2NewlineMask(const char* p)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+    uint64_t loBits = static_cast<uint32_t>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl)));
+    uint64_t hiBits = static_cast<uint32_t>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl)));
+    return loBits | (hiBits << 32);
+}
+#endif
+
+#if defined(__aarch64__)
+/* NEON has no movemask, so we keep one weighted bit per byte and add the
+halves up. */
+static inline uint64_t neonNewlineMask(const char* p)
+{
+    static const uint8_t weights[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    const uint8x16_t bits = vld1q_u8(weights);
+    uint64_t m = 0;
+    for (int i = 0; i < 4; ++i) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p + 16 * i));
+        v = vandq_u8(vceqq_u8(v, nl), bits);
+        uint64_t lo = vaddv_u8(vget_low_u8(v));
+        uint64_t hi = vaddv_u8(vget_high_u8(v));
+        m |= (lo | (hi << 8)) << (16 * i);
+    }
+    return m;
+}
+#endif
+
+typedef void (*LineScanner)(const Slice&, uint64_t, std::vector<Line>&);
+
+/* One scanner for each dialect, in the order of Dialect. */
+template <template <LineClassifier> class Scanner>
+struct DialectScanners {
+    LineScanner scanners[dialectCount] = {
+        Scanner<classifyLine>::scan,
+        Scanner<classifyAs<false, 0>>::scan,
+        Scanner<classifyAs<false, 1>>::scan,
+        Scanner<classifyAs<false, 2>>::scan,
+        Scanner<classifyAs<true, 0>>::scan,
+        Scanner<classifyAs<true, 1>>::scan,
+        Scanner<classifyAs<true, 2>>::scan,
+    };
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+template <LineClassifier classify>
+struct Avx2Scanner {
+    static void scan(const Slice& b, uint64_t o, std::vector<Line>& l)
+    {
+        scanLinesWith<avx2NewlineMask, classify>(b, o, l);
+    }
+};
+#endif
+
+template <LineClassifier classify>
+struct DefaultScanner {
+    static void scan(const Slice& b, uint64_t o, std::vector<Line>& l)
+    {
+#if defined(__SSE2__)
+        scanLinesWith<sse2NewlineMask, classify>(b, o, l);
+#elif defined(__aarch64__)
+        scanLinesWith<neonNewlineMask, classify>(b, o, l);
+#else
+        scanLinesScalar<classify>(b, o, l);
+#endif
+    }
+};
+
+/* The widest scanners this CPU supports. */
+static const LineScanner* pickLineScanners()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const DialectScanners<Avx2Scanner> avx2;
+    if (__builtin_cpu_supports("avx2"))
+        return avx2.scanners;
+#endif
+    static const DialectScanners<DefaultScanner> other;
+    return other.scanners;
+}
+
+/* Cut a block of the input into lines, and classify them, in one pass.
+offset is where the block starts in the input. The dialect is the log's,
+see sniffDialect(). */
+void scanLines(const Slice& block, uint64_t offset, std::vector<Line>& lines,
+        Dialect dialect = AnyDialect)
+{
+    static const LineScanner* scanners = pickLineScanners();
+    lines.clear();
+    scanners[dialect](block, offset, lines);
+}
+
+/* The dialect of a log, what most of the relay lines at the start of it
+print. A wrong guess only costs time, the lines that don't fit go through
+classifyLine() and come out the same. */
+Dialect sniffDialect(const Slice& block)
+{
+    static const size_t sniffSize = 64 << 10;
+    static const int sniffLines = 64;
+
+    std::vector<Line> lines;
+    scanLines(Slice(block.data, std::min(block.size, sniffSize)), 0, lines);
+    int votes[dialectCount] = {};
+    int seen = 0;
+    for (const auto& line : lines) {
+        if (line.kind == OtherLine)
+            continue;
+        int groups = std::count(line.text.data, line.text.data + line.token,
+                ':') - line.hasTime;
+        ++votes[groups > 2 ? AnyDialect : PlainDialect + groups
+                + (line.hasTime ? TimedPlainDialect - PlainDialect : 0)];
+        if (++seen == sniffLines)
+            break;
+    }
+    return static_cast<Dialect>(std::max_element(votes, votes + dialectCount)
+            - votes);
+}
+
+/* FNV-1a, so we can hash slices. */
+struct SliceHash {
+    size_t operator()(const Slice& s) const
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (size_t i = 0; i < s.size; ++i)
+            h = (h ^ static_cast<unsigned char>(s[i])) * 1099511628211ull;
+        return h;
+    }
+};
+
+/* Where the names live. Big blocks that never move, so a name is a slice
+that stays valid, and interning a name doesn't allocate a string for it. */
+struct Arena {
+    static const size_t blockSize = 64 << 10;
+
+    Slice store(const Slice& s)
+    {
+        if (blocks.empty() || used + s.size > blockSize) {
+            blocks.emplace_back(new char[std::max(blockSize, s.size)]);
+            used = 0;
+        }
+        char* p = blocks.back().get() + used;
+        std::memcpy(p, s.data, s.size);
+        used += s.size;
+        return Slice(p, s.size);
+    }
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t used = 0; // In the last block.
+};
+
+/* Interns "DLL.Function" names, so a call can be matched to its return by
+comparing two integers. The pipeline only touches this from the main thread,
+the chunked engine goes through internShared().
+A real trace has a few thousand names repeated millions of times, so this is
+a flat open addressing table: one probe into one array nearly every time,
+and the hash we keep in the slot sorts out almost every collision before we
+ever compare a string. The names themselves are in the arena. */
+struct NameTable {
+    static const unsigned int unknown = ~0u; // Name was never interned.
+
+    struct Slot {
+        unsigned int id = unknown;
+        uint32_t hash = 0;
+    };
+
+    NameTable() : slots(1024) {}
+
+    /* Returns the id of name, adding it if we have never seen it. */
+    unsigned int intern(const Slice& name)
+    {
+        uint64_t h = SliceHash()(name);
+        Slot& slot = lookup(name, h);
+        if (slot.id != unknown)
+            return slot.id;
+        slot.id = names.size();
+        slot.hash = static_cast<uint32_t>(h);
+        names.push_back(arena.store(name));
+
+        /* Keep it half empty, the probes stay short. */
+        if (2 * names.size() > slots.size())
+            grow();
+        return names.size() - 1;
+    }
+
+    /* Returns the id of name, or unknown. A ret of a function we have never
+    seen a call for can't match anything anyways. */
+    unsigned int find(const Slice& name)
+    {
+        return lookup(name, SliceHash()(name)).id;
+    }
+
+    /* intern() for the classifiers of the chunked engine, they run on every
+    thread at once. Each keeps its own cache in front of this, so the lock is
+    only taken for names that thread hasn't seen yet. */
+    unsigned int internShared(const Slice& name)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return intern(name);
+    }
+
+    const Slice& name(unsigned int id) const { return names[id]; }
+    size_t size() const { return names.size(); }
+
+    /* The slot of name, or the empty one where it goes. */
+    Slot& lookup(const Slice& name, uint64_t h)
+    {
+        uint32_t hash = static_cast<uint32_t>(h);
+        size_t mask = slots.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            Slot& slot = slots[i];
+            if (slot.id == unknown
+                    || (slot.hash == hash && names[slot.id] == name))
+                return slot;
+        }
+    }
+
+    void grow()
+    {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const auto& x : old) {
+            if (x.id == unknown)
+                continue;
+            size_t i = SliceHash()(names[x.id]) & mask;
+            while (slots[i].id != unknown)
+                i = (i + 1) & mask;
+            slots[i] = x;
+        }
+    }
+
+    std::vector<Slot> slots; // A power of 2 of them.
+    std::vector<Slice> names; // By id, they point in the arena.
+    Arena arena;
+    std::mutex mutex; // For internShared().
+};
+
+/* Matches a glob, * and ? only, against a name. DLL names come both ways
+in Wine logs, KERNEL32 and kernel32, so they can ignore case. */
+static bool globMatch(const char* p, const char* pEnd, const char* s,
+        const char* sEnd, bool noCase)
+{
+    auto same = [noCase](char a, char b) {
+        return a == b || (noCase && std::tolower(static_cast<unsigned char>(a))
+                == std::tolower(static_cast<unsigned char>(b)));
+    };
+
+    /* Backtrack to the last star only, that is enough for * and ?. */
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (s < sEnd) {
+        if (p < pEnd && *p == '*') {
+            star = p++;
+            resume = s;
+        } else if (p < pEnd && (*p == '?' || same(*p, *s))) {
+            ++p;
+            ++s;
+        } else if (star) {
+            p = star + 1;
+            s = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < pEnd && *p == '*')
+        ++p;
+    return p == pEnd;
+}
+
+/* --include and --exclude. A pattern is "DLL.Function" with globs on both
+sides, "NTDLL.Rtl*", "*.HeapAlloc", or only a DLL for all of its functions.
+With includes, only the functions matching one of them are kept, and the
+excludes take out what they match from that. The calls and rets of the
+functions we don't keep are dropped when the lines are classified, like they
+were matched, so they never cost a record, a stack push or a match.
+Globs are slow, but a name is only ever looked at once: the verdict is kept
+by its interned id. */
+struct Filter {
+    struct Pattern {
+        std::string dll;
+        std::string function;
+    };
+
+    /* A comma separated list of patterns. */
+    void add(const std::string& list, bool include)
+    {
+        size_t start = 0;
+        while (start <= list.size()) {
+            size_t end = std::min(list.find(',', start), list.size());
+            std::string x = list.substr(start, end - start);
+            start = end + 1;
+            if (x.empty())
+                continue;
+
+            Pattern p;
+            auto dot = x.find('.');
+            p.dll = x.substr(0, dot);
+            p.function = dot == std::string::npos ? "*" : x.substr(dot + 1);
+            (include ? includes : excludes).push_back(p);
+        }
+    }
+
+    bool empty() const { return includes.empty() && excludes.empty(); }
+
+    /* Whether we keep the calls and rets of name, "DLL.Function". */
+    bool keep(const Slice& name) const
+    {
+        if (empty())
+            return true;
+        return (includes.empty() || matchesAny(includes, name))
+                && !matchesAny(excludes, name);
+    }
+
+    static bool matchesAny(const std::vector<Pattern>& patterns,
+            const Slice& name)
+    {
+        const char* begin = name.data;
+        const char* end = name.data + name.size;
+        auto dot = name.findFirstOf('.');
+        const char* split = dot == Slice::npos ? end : begin + dot;
+        const char* function = dot == Slice::npos ? end : split + 1;
+        for (const auto& p : patterns) {
+            const char* d = p.dll.data();
+            const char* f = p.function.data();
+            if (globMatch(d, d + p.dll.size(), begin, split, true)
+                    && globMatch(f, f + p.function.size(), function, end, false))
+                return true;
+        }
+        return false;
+    }
+
+    std::vector<Pattern> includes;
+    std::vector<Pattern> excludes;
+};
+
+/* Everything we need to know about a Call or Ret line to match them. It is
+filled once when the line is read, so matching compares integers instead of
+scanning strings. */
+struct CallRecord {
+    unsigned int threadId = 0; // Wine thread id.
+    unsigned int function = NameTable::unknown; // Interned function name.
+    uint64_t retAddr = 0; // The "ret=" address, the caller.
+    bool hasRetAddr = false; // Some calls don't print one.
+    bool hasTime = false;
+    uint32_t time = 0; // Milliseconds, if the line has a timestamp.
+    uint64_t offset = 0; // Byte offset of the line in the input file.
+};
+
+/* Get the function name out of a line, what sits between the Call or Ret
+token and the opening bracket. "0009:Call KERNEL32.Sleep(...)" gives
+"KERNEL32.Sleep". */
+Slice parseFunction(const Line& line)
+{
+    auto begin = line.text.findFirstNotOf(' ',
+            line.token + (line.kind == CallLine ? 4 : 3));
+    if (begin == Slice::npos)
+        return Slice();
+    auto end = line.text.findFirstOf('(', begin);
+    return line.text.substr(begin, end == Slice::npos ? end : end - begin);
+}
+
+/* Fill in the thread id and the return address, the function is resolved
+by the caller since calls and rets use the name table differently. */
+CallRecord parseRecord(const Line& l)
+{
+    const Slice& line = l.text;
+    CallRecord r;
+    r.threadId = l.threadId;
+    r.offset = l.offset;
+    r.hasTime = l.hasTime;
+    r.time = l.time;
+
+    /* The return address is the last field of both calls and rets. */
+    auto addr = line.rfind("ret=");
+    if (addr != Slice::npos) {
+        r.hasRetAddr = true;
+        for (auto i = addr + 4; i < line.size && hexDigit(line[i]) >= 0; ++i)
+            r.retAddr = (r.retAddr << 4) | hexDigit(line[i]);
+    }
+    return r;
+}
+
+/* Our actual work. Since the software requires to store the call, and later
+process it, we don't use std::function. Of course that would be a nicer way
+to go about it. All this does is store the parsed call, and compare it with
+a parsed ret. The line itself is only kept around for the final output. When
+the input is mapped it is at its offset in the mapping. Else whoever holds us
+keeps a copy in a buffer of theirs, so a pending call is a few plain bytes
+and never owns a string. */
+struct Parser {
+    /* Store the payload. */
+    Parser(CallRecord record, uint32_t size, uint64_t text)
+        : Record(record)
+        , Size(size)
+        , Text(text)
+    {
+    }
+
+    /* The line of the call. base is the mapping, or where our holder keeps
+    the copies. */
+    Slice text(const char* base) const
+    {
+        return Slice(base + Text, Size);
+    }
+
+    /* Our copy goes to another holder, at the end of its buffer. */
+    void moveText(const char* from, std::vector<char>& to)
+    {
+        uint64_t at = to.size();
+        to.insert(to.end(), from + Text, from + Text + Size);
+        Text = at;
+    }
+
+    /* Process the payload. This used to be the single most expensive
+    operation of the entire software, it is now two integer compares. */
+    bool operator()(const CallRecord& Ret) const
+    {
+        /* Do we match the "ret"urn? */
+        if (Ret.function != Record.function)
+            return false;
+
+        /* There was no return address, assume we match. */
+        if (!Record.hasRetAddr)
+            return true;
+
+        /* Do we also match the address? */
+        return Ret.hasRetAddr && Ret.retAddr == Record.retAddr;
+    }
+
+    CallRecord Record;
+    uint32_t Size; // Of the line.
+    uint64_t Text; // Where the line is.
+};
+
+/* Writes or reads a whole piece of a temporary file, or gives up: there is
+nothing sensible left to do once the disk is full. */
+static void tempFileIo(bool write, std::FILE* file, void* data, size_t size,
+        uint64_t at)
+{
+    ssize_t n = !file ? -1 : write ? pwrite(fileno(file), data, size, at)
+            : pread(fileno(file), data, size, at);
+    if (n != static_cast<ssize_t>(size)) {
+        *status << "Couldn't " << (write ? "write" : "read")
+                << " the temporary file." << std::endl;
+        std::exit(1);
+    }
+}
+
+/* A FIFO of bytes in a temporary file, for when the reorder window is full.
+We append at one end and read back from the other, both through our own
+buffers so we don't do a syscall per line. */
+struct SpillFile {
+    static const size_t bufferSize = 1 << 20;
+
+    SpillFile() : file(std::tmpfile()) {}
+    ~SpillFile() { if (file) std::fclose(file); }
+
+    bool empty() const
+    {
+        return readPos == writePos && writeBuffer.empty()
+                && readHead == readBuffer.size();
+    }
+
+    void write(const void* data, size_t size)
+    {
+        auto p = static_cast<const char*>(data);
+        writeBuffer.insert(writeBuffer.end(), p, p + size);
+        if (writeBuffer.size() >= bufferSize)
+            flush();
+    }
+
+    /* Read exactly size bytes, returns false if we don't have them. */
+    bool read(void* data, size_t size)
+    {
+        auto p = static_cast<char*>(data);
+        while (size) {
+            if (readHead == readBuffer.size() && !fill())
+                return false;
+            size_t n = std::min(size, readBuffer.size() - readHead);
+            std::memcpy(p, &readBuffer[readHead], n);
+            readHead += n;
+            p += n;
+            size -= n;
+        }
+
+        /* Everything was read back, start over at the beginning of the
+        file so it doesn't grow forever. The space is simply reused. */
+        if (empty())
+            readPos = writePos = 0;
+        return true;
+    }
+
+    void flush()
+    {
+        if (writeBuffer.empty())
+            return;
+        if (!file || pwrite(fileno(file), writeBuffer.data(),
+                writeBuffer.size(), writePos)
+                != static_cast<ssize_t>(writeBuffer.size())) {
+            *status << "Couldn't write the temporary file." << std::endl;
+            std::exit(1);
+        }
+        writePos += writeBuffer.size();
+        writeBuffer.clear();
+    }
+
+    /* Get the next piece of the file in the read buffer. */
+    bool fill()
+    {
+        if (readPos == writePos)
+            flush();
+        size_t n = std::min<uint64_t>(bufferSize, writePos - readPos);
+        readBuffer.resize(n);
+        readHead = 0;
+        if (!n || pread(fileno(file), &readBuffer[0], n, readPos)
+                != static_cast<ssize_t>(n))
+            return false;
+        readPos += n;
+        return true;
+    }
+
+    std::FILE* file;
+    uint64_t readPos = 0; // What was read back from the file.
+    uint64_t writePos = 0; // What was written to the file.
+    std::vector<char> writeBuffer;
+    std::vector<char> readBuffer;
+    size_t readHead = 0;
+};
+
+/* The lines that go straight to the output. We can't always write them right
+away, an older call could still turn out to be unmatched and has to go in
+front of them. So they wait here, in input order. For mapped input we only
+need to remember where they were, and consecutive lines are kept as one run.
+Otherwise we keep a copy of the text.
+Once we hold more than memoryLimit bytes, new lines are spilled to a
+temporary file instead, so our memory doesn't grow with the log. */
+struct Passthrough {
+    /* A run of lines in the input, the last newline is not included. */
+    struct Run {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    Passthrough(const char* m, size_t limit) : mapping(m), memoryLimit(limit) {}
+
+    bool empty() const { return runs.empty() && spill.empty() && !hasRun; }
+
+    /* Keep the line for the output. */
+    void add(const Line& line)
+    {
+        if (mapping && hasRun && run.offset + run.size + 1 == line.offset) {
+            run.size = line.offset + line.text.size - run.offset;
+            return;
+        }
+        close();
+        run.offset = line.offset;
+        run.size = line.text.size;
+        hasRun = true;
+
+        /* The line won't be around later, keep its text too. */
+        if (!mapping)
+            text.insert(text.end(), line.text.data,
+                    line.text.data + line.text.size);
+    }
+
+    /* A run a classifier already cut out of a chunk, mapped input only. */
+    void add(const Run& r)
+    {
+        if (hasRun && run.offset + run.size + 1 == r.offset) {
+            run.size = r.offset + r.size - run.offset;
+            return;
+        }
+        close();
+        run = r;
+        hasRun = true;
+    }
+
+    /* The run we are growing is done, queue it. */
+    void close()
+    {
+        if (!hasRun)
+            return;
+        hasRun = false;
+
+        /* Once we spill, everything has to go through the spill until it is
+        empty again, or we would mix up the order. */
+        if (spill.empty() && memory() <= memoryLimit) {
+            runs.push_back(run);
+            return;
+        }
+        spill.write(&run, sizeof(run));
+        if (!mapping) {
+            spill.write(&text[text.size() - run.size], run.size);
+            text.resize(text.size() - run.size);
+        }
+    }
+
+    /* The oldest run we have, with its text. */
+    bool front(Run& r, Slice& t)
+    {
+        if (runs.empty() && !readSpill())
+            return false;
+        r = runs.front();
+        t = mapping ? Slice(mapping + r.offset, r.size)
+                : Slice(&text[textHead], r.size);
+        return true;
+    }
+
+    void pop()
+    {
+        if (!mapping)
+            textHead += runs.front().size;
+        runs.pop_front();
+
+        /* Don't let the text grow at the front. */
+        if (textHead > text.size() / 2) {
+            text.erase(text.begin(), text.begin() + textHead);
+            textHead = 0;
+        }
+    }
+
+    /* Our memory is drained, get the next run back from the spill. */
+    bool readSpill()
+    {
+        Run r;
+        if (spill.empty() || !spill.read(&r, sizeof(r)))
+            return false;
+        if (!mapping) {
+            /* Text of the run still growing stays behind it. */
+            size_t tail = hasRun ? run.size : 0;
+            text.insert(text.end() - tail, r.size, '\0');
+            if (!spill.read(&text[text.size() - tail - r.size], r.size))
+                return false;
+        }
+        runs.push_back(r);
+        return true;
+    }
+
+    /* What we hold in memory. */
+    size_t memory() const
+    {
+        return runs.size() * sizeof(Run) + text.size() - textHead;
+    }
+
+    const char* mapping; // The input, if it is mapped.
+    size_t memoryLimit;
+    bool hasRun = false;
+    Run run; // The run we are growing.
+    std::deque<Run> runs; // Queued runs, oldest first.
+    std::vector<char> text; // Their text, if the input isn't mapped.
+    size_t textHead = 0; // Text of the oldest run.
+    SpillFile spill;
+};
+
+/* Everything we keep for the output, until nothing older can show up
+anymore. That is the case once no call older than a line is still waiting
+for its ret: the watermark is the offset of the oldest pending call, and
+everything below it is final and written out.
+The unmatched calls come in any order, so if the input isn't mapped their
+copies leave holes in our buffer as they are written. It is compacted once
+it is mostly holes, which is linear in what is left, so it stays O(1) per
+call. */
+struct ReorderWindow {
+    static const size_t memoryLimit = 64 << 20;
+    static const size_t compactSize = 1 << 20; // Don't bother below this.
+
+    ReorderWindow(const char* m) : mapping(m), passthrough(m, memoryLimit) {}
+
+    /* The unmatched calls that went to disk, --max-mem: sorted by offset,
+    a run of them every time we held too many. They all go in one file, and
+    are merged back as they are written. Each run only keeps a little of
+    itself in memory. */
+    static const size_t runBuffer = 64 << 10;
+
+    struct CallRun {
+        uint64_t pos; // Where the rest of it starts in runFile.
+        uint64_t end;
+        std::vector<char> buffer;
+        size_t used = 0; // Of the buffer.
+        Parser next = Parser(CallRecord(), 0, 0); // The oldest left.
+        std::vector<char> text; // Its line, if the input isn't mapped.
+    };
+
+    ~ReorderWindow()
+    {
+        if (runFile)
+            std::fclose(runFile);
+    }
+
+    /* A call known to be unmatched. from is where its line is if the input
+    isn't mapped. */
+    void unmatched(Parser call, const char* from)
+    {
+        if (!mapping)
+            call.moveText(from, copies);
+        calls.push_back(call);
+        std::push_heap(calls.begin(), calls.end(), newer);
+        if (calls.size() * sizeof(Parser) + copies.size() - holes > callLimit)
+            spillCalls();
+    }
+
+    /* All the calls we hold go to a new run. */
+    void spillCalls()
+    {
+        if (!runFile)
+            runFile = std::tmpfile();
+        std::sort(calls.begin(), calls.end(),
+                [](const Parser& a, const Parser& b) {
+                    return a.Record.offset < b.Record.offset;
+                });
+        std::unique_ptr<CallRun> run(new CallRun());
+        run->pos = runFileSize;
+        std::vector<char> out;
+        for (size_t i = 0; i <= calls.size(); ++i) {
+            if (out.size() >= runBuffer || (i == calls.size() && !out.empty())) {
+                tempFileIo(true, runFile, out.data(), out.size(), runFileSize);
+                runFileSize += out.size();
+                out.clear();
+            }
+            if (i == calls.size())
+                break;
+            const Parser& call = calls[i];
+            auto p = reinterpret_cast<const char*>(&call);
+            out.insert(out.end(), p, p + sizeof(call));
+            if (!mapping)
+                out.insert(out.end(), copies.data() + call.Text,
+                        copies.data() + call.Text + call.Size);
+        }
+        run->end = runFileSize;
+        spilledCalls += calls.size();
+        calls.clear();
+        copies.clear();
+        holes = 0;
+        if (nextOfRun(*run)) {
+            runHeap.push_back(run.get());
+            std::push_heap(runHeap.begin(), runHeap.end(), laterRun);
+        }
+        callRuns.push_back(std::move(run));
+    }
+
+    /* Read the next call of a run, false if there is none. */
+    bool nextOfRun(CallRun& run)
+    {
+        if (!readRun(run, &run.next, sizeof(run.next)))
+            return false;
+        if (!mapping) {
+            run.text.resize(run.next.Size);
+            readRun(run, run.text.data(), run.next.Size);
+            run.next.Text = 0;
+        }
+        return true;
+    }
+
+    bool readRun(CallRun& run, void* data, size_t size)
+    {
+        auto p = static_cast<char*>(data);
+        while (size) {
+            if (run.used == run.buffer.size()) {
+                size_t n = std::min<uint64_t>(runBuffer, run.end - run.pos);
+                if (!n)
+                    return false;
+                run.buffer.resize(n);
+                tempFileIo(false, runFile, &run.buffer[0], n, run.pos);
+                run.pos += n;
+                run.used = 0;
+            }
+            size_t n = std::min(size, run.buffer.size() - run.used);
+            std::memcpy(p, &run.buffer[run.used], n);
+            run.used += n;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    /* The oldest call of the runs was written. */
+    void popRun()
+    {
+        std::pop_heap(runHeap.begin(), runHeap.end(), laterRun);
+        CallRun* run = runHeap.back();
+        if (nextOfRun(*run)) {
+            std::push_heap(runHeap.begin(), runHeap.end(), laterRun);
+            return;
+        }
+        runHeap.pop_back();
+        for (size_t i = 0; i < callRuns.size(); ++i) {
+            if (callRuns[i].get() == run)
+                callRuns.erase(callRuns.begin() + i);
+        }
+    }
+
+    static bool laterRun(const CallRun* a, const CallRun* b)
+    {
+        return a->next.Record.offset > b->next.Record.offset;
+    }
+
+    /* Write everything older than watermark, oldest first. */
+    void flush(OutputSink& os, uint64_t watermark)
+    {
+        passthrough.close();
+
+        Passthrough::Run run;
+        Slice text;
+        while (true) {
+            bool hasRun = passthrough.front(run, text);
+            CallRun* spilled = runHeap.empty() ? nullptr : runHeap.front();
+            bool fromRun = spilled && (calls.empty()
+                    || spilled->next.Record.offset < calls.front().Record.offset);
+            const Parser* call = fromRun ? &spilled->next
+                    : calls.empty() ? nullptr : &calls.front();
+            bool hasCall = call != nullptr;
+            uint64_t callOffset = hasCall ? call->Record.offset : 0;
+
+            /* The next passthrough run goes first. */
+            if (hasRun && (!hasCall || run.offset < callOffset)) {
+                if (run.offset >= watermark)
+                    break;
+                os.line(text);
+                passthrough.pop();
+                continue;
+            }
+
+            /* Or the oldest unmatched call. */
+            if (!hasCall || callOffset >= watermark)
+                break;
+            if (fromRun) {
+                os.line(call->text(mapping ? mapping : spilled->text.data()));
+                if (keepWritten)
+                    written.push_back(callOffset);
+                ++callsWritten;
+                popRun();
+                continue;
+            }
+            os.line(calls.front().text(mapping ? mapping : copies.data()));
+            if (!mapping)
+                holes += calls.front().Size;
+            if (keepWritten)
+                written.push_back(callOffset);
+            ++callsWritten;
+            std::pop_heap(calls.begin(), calls.end(), newer);
+            calls.pop_back();
+        }
+
+        if (holes > compactSize && holes > copies.size() / 2)
+            compact();
+    }
+
+    /* Everything we still hold, oldest first, and we hold nothing after.
+    Nothing is written: --follow keeps it for the next refresh. Only for
+    mapped input, the offsets are all we keep. */
+    void take(std::vector<Passthrough::Run>& runs, std::vector<uint64_t>& offsets)
+    {
+        passthrough.close();
+        Passthrough::Run run;
+        Slice text;
+        while (passthrough.front(run, text)) {
+            runs.push_back(run);
+            passthrough.pop();
+        }
+        for (const auto& call : calls)
+            offsets.push_back(call.Record.offset);
+        while (!runHeap.empty()) {
+            offsets.push_back(runHeap.front()->next.Record.offset);
+            popRun();
+        }
+        std::sort(offsets.begin(), offsets.end());
+        calls.clear();
+    }
+
+    /* Copy the calls left to a new buffer, without the holes. */
+    void compact()
+    {
+        std::vector<char> live;
+        live.reserve(copies.size() - holes);
+        for (auto& call : calls)
+            call.moveText(copies.data(), live);
+        copies.swap(live);
+        holes = 0;
+    }
+
+    /* Heap order, the oldest call on top. */
+    static bool newer(const Parser& a, const Parser& b)
+    {
+        return a.Record.offset > b.Record.offset;
+    }
+
+    const char* mapping; // The input, if it is mapped.
+    Passthrough passthrough;
+    std::vector<Parser> calls; // Unmatched calls, a heap.
+    std::vector<char> copies; // Their lines, if the input isn't mapped.
+    size_t callLimit = std::numeric_limits<size_t>::max(); // --max-mem.
+    std::vector<std::unique_ptr<CallRun>> callRuns;
+    std::vector<CallRun*> runHeap; // The oldest next call on top.
+    std::FILE* runFile = nullptr;
+    uint64_t runFileSize = 0;
+    uint64_t spilledCalls = 0; // For --stats.
+    uint64_t callsWritten = 0; // The unmatched calls, for --stats.
+    bool keepWritten = false;
+    std::vector<uint64_t> written; // Their offsets, for the index.
+    size_t holes = 0; // Bytes in copies of calls already written.
+};
+
+/* A lock-free ring buffer, for exactly one producer and one consumer. This
+is how work moves between the threads: nobody takes a lock to hand over a
+batch. The size has to be a power of 2. */
+template <typename T>
+struct Ring {
+    Ring(size_t n) : slots(n), mask(n - 1) {}
+
+    bool push(const T& x)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size())
+            return false; // Full.
+        slots[t & mask] = x;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& x)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false; // Empty.
+        x = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return head.load(std::memory_order_acquire)
+                == tail.load(std::memory_order_acquire);
+    }
+
+    std::vector<T> slots;
+    size_t mask;
+    std::atomic<size_t> head{0}; // Consumer side.
+    char pad[64]; // Keep the two sides on their own cache lines.
+    std::atomic<size_t> tail{0}; // Producer side.
+};
+
+/* Sleep until something shows up in a ring. The old condition variable
+lockstep could lose a notify sent while a thread was busy, and that line was
+never matched. Here the waiter says it is going to sleep and then checks
+again, the other side checks that flag after publishing its work, so one of
+the two always sees the other. The mutex is only touched when somebody
+actually sleeps. */
+struct Doorbell {
+    void ring()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            wakeUp.notify_one();
+        }
+    }
+
+    template <typename Ready>
+    void wait(Ready ready)
+    {
+        /* Spin a little first, a batch is usually right behind. */
+        for (int i = 0; i < 64; ++i) {
+            if (ready())
+                return;
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!ready())
+            wakeUp.wait(lock);
+        sleeping.store(false);
+    }
+
+    std::atomic<bool> sleeping{false};
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+};
+
+struct Chunk;
+
+/* A batch of work for a thread. The main thread fills it with the parsed
+calls and rets of the Wine threads that thread owns, in input order, and
+hands it over in one go, so the hand-over and wake-up cost is paid once for
+thousands of lines. The thread fills in the results and hands it back to be
+reused. */
+struct Batch {
+    static const size_t capacity = 4096;
+
+    struct Entry {
+        CallRecord record;
+        uint32_t size; // Length of the line.
+        uint32_t text; // Where the copy of the line is, if there is one.
+        LineKind kind;
+    };
+
+    void clear()
+    {
+        entries.clear();
+        text.clear();
+        unmatched.clear();
+        unmatchedText.clear();
+    }
+
+    bool full() const { return entries.size() == capacity; }
+
+    std::vector<Entry> entries;
+    std::vector<char> text; // Copies of the calls, if the input isn't mapped.
+
+    /* Every line of ours before this offset is in this batch or an older
+    one. */
+    uint64_t end = 0;
+    Chunk* chunk = nullptr; // The chunk we belong to, for the chunked engine.
+
+    /* Filled in by the thread. */
+    std::vector<Parser> unmatched; // Calls we know will never be matched.
+    std::vector<char> unmatchedText; // Their lines, if the input isn't mapped.
+    uint64_t oldest = 0; // Offset of the oldest call still pending after.
+    int pending = 0; // Calls still pending after.
+};
+
+/* The entry of a call or ret line, all but the function id. */
+Batch::Entry makeEntry(const Line& line)
+{
+    Batch::Entry e;
+    e.record = parseRecord(line);
+    e.kind = line.kind;
+    e.size = line.text.size;
+    e.text = 0;
+    return e;
+}
+
+/* The index of a log, --index. Parsing a big log again for every new
+filter redoes all the reading and matching, the index keeps what came out of
+it next to the log, in yourlog.txt.pwi: the calls and rets, the runs of
+lines we pass through and the function names. It is columnar, one array per
+field, so it can be mapped and read straight away. A field of record i is at
+i in its column. */
+struct IndexHeader {
+    static const uint32_t currentVersion = 2;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t logSize; // The log it belongs to, it is stale if that changed.
+    int64_t logTime; // Its mtime, in ns.
+    uint64_t lines;
+    uint64_t records; // Calls and rets.
+    uint64_t runs;
+    uint64_t names;
+    uint64_t namesSize; // Bytes.
+    uint64_t marks;
+};
+
+/* Where a line starts, so a line number can be found without counting all
+the lines in front of it. The index has one per block. */
+struct LineMark {
+    uint64_t offset;
+    uint64_t line; // From 0.
+};
+
+/* What a record is, in the flags column. */
+enum IndexFlag : unsigned char {
+    IndexRet = 1, // Else a call.
+    IndexRetAddr = 2,
+    IndexTime = 4,
+    IndexMatched = 8, // A call that got its ret.
+};
+
+/* The index and --binary are both files of columns, each 8 byte aligned,
+behind a header. Sections hands out where they go, in order. */
+struct Sections {
+    Sections(uint64_t header) : at(header) {}
+
+    uint64_t next(uint64_t size)
+    {
+        uint64_t x = at;
+        at += (size + 7) & ~uint64_t(7);
+        return x;
+    }
+
+    uint64_t at;
+};
+
+/* The columns both have: the function names, and a record of each call,
+and of each ret for the index. */
+struct RecordLayout {
+    void place(Sections& s, uint64_t names, uint64_t namesSize, uint64_t records)
+    {
+        nameEnds = s.next(4 * names);
+        this->names = s.next(namesSize);
+        offsets = s.next(8 * records);
+        retAddrs = s.next(8 * records);
+        sizes = s.next(4 * records);
+        threads = s.next(4 * records);
+        functions = s.next(4 * records);
+        times = s.next(4 * records);
+        flags = s.next(records);
+    }
+
+    uint64_t nameEnds; // Where each name ends in names.
+    uint64_t names;
+    uint64_t offsets; // Of the lines in the log.
+    uint64_t retAddrs;
+    uint64_t sizes; // Of the lines.
+    uint64_t threads;
+    uint64_t functions;
+    uint64_t times;
+    uint64_t flags;
+};
+
+/* Where the columns are in the index. */
+struct IndexLayout : RecordLayout {
+    IndexLayout(const IndexHeader& h)
+    {
+        Sections s(sizeof(IndexHeader));
+        place(s, h.names, h.namesSize, h.records);
+        runs = s.next(sizeof(Passthrough::Run) * h.runs);
+        marks = s.next(sizeof(LineMark) * h.marks);
+        total = s.at;
+    }
+
+    uint64_t runs;
+    uint64_t marks;
+    uint64_t total;
+};
+
+/* The mtime of a file, what tells us an index is stale. */
+int64_t modifiedTime(const std::string& f)
+{
+    struct stat st;
+    if (stat(f.c_str(), &st) != 0)
+        return -1;
+    return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+/* Writes a file of columns: open() it at its final size, put() everything
+where it goes, and commit(). It is written next to path and renamed, so
+nobody ever reads half of one. */
+struct ColumnWriter {
+    bool open(const std::string& path, uint64_t total)
+    {
+        target = path;
+        tmp = path + ".tmp";
+        fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ok = fd >= 0 && ftruncate(fd, total) == 0;
+        return fd >= 0;
+    }
+
+    bool put(uint64_t at, const void* data, size_t size)
+    {
+        ok = ok && pwrite(fd, data, size, at) == static_cast<ssize_t>(size);
+        return ok;
+    }
+
+    /* A whole column from its spill. */
+    bool copy(SpillFile& from, uint64_t at, uint64_t size)
+    {
+        std::vector<char> buffer(SpillFile::bufferSize);
+        while (ok && size) {
+            size_t n = std::min<uint64_t>(size, buffer.size());
+            ok = from.read(buffer.data(), n) && put(at, buffer.data(), n);
+            at += n;
+            size -= n;
+        }
+        return ok;
+    }
+
+    /* The names, and where each one ends. */
+    bool names(const NameTable& names, const RecordLayout& l)
+    {
+        std::vector<char> buffer;
+        std::vector<uint32_t> ends;
+        for (size_t i = 0; i < names.size(); ++i) {
+            const Slice& n = names.name(i);
+            buffer.insert(buffer.end(), n.data, n.data + n.size);
+            ends.push_back(buffer.size());
+        }
+        return put(l.nameEnds, ends.data(), 4 * ends.size())
+                && put(l.names, buffer.data(), buffer.size());
+    }
+
+    bool commit()
+    {
+        ok = ::close(fd) == 0 && ok;
+        if (ok && rename(tmp.c_str(), target.c_str()) == 0)
+            return true;
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    static uint64_t namesSize(const NameTable& names)
+    {
+        uint64_t n = 0;
+        for (size_t i = 0; i < names.size(); ++i)
+            n += names.name(i).size;
+        return n;
+    }
+
+    std::string target;
+    std::string tmp;
+    int fd = -1;
+    bool ok = false;
+};
+
+/* The records as they come in, in input order, to one spill per column: a
+30 GB log has a few GB of them. Once we know how many there are, the
+columns are copied where they go. */
+struct RecordColumns {
+    static const size_t blockRecords = 1 << 16;
+
+    void record(const Batch::Entry& e)
+    {
+        const CallRecord& r = e.record;
+        offsets.write(&r.offset, 8);
+        retAddrs.write(&r.retAddr, 8);
+        sizes.write(&e.size, 4);
+        threads.write(&r.threadId, 4);
+        functions.write(&r.function, 4);
+        times.write(&r.time, 4);
+        unsigned char f = (e.kind == RetLine ? IndexRet : 0)
+                | (r.hasRetAddr ? IndexRetAddr : 0)
+                | (r.hasTime ? IndexTime : 0);
+        flags.write(&f, 1);
+        ++records;
+    }
+
+    /* All of them where l says. unmatched are the offsets of the calls that
+    never got their ret, in order. The other calls get the matched bit on the
+    way, by the offsets. */
+    bool write(ColumnWriter& w, const RecordLayout& l,
+            const std::vector<uint64_t>& unmatched)
+    {
+        std::vector<uint64_t> at(blockRecords);
+        std::vector<unsigned char> f(blockRecords);
+        size_t next = 0; // In unmatched.
+        for (uint64_t i = 0; w.ok && i < records; i += blockRecords) {
+            size_t n = std::min<uint64_t>(blockRecords, records - i);
+            w.ok = offsets.read(at.data(), 8 * n) && flags.read(f.data(), n)
+                    && w.put(l.offsets + 8 * i, at.data(), 8 * n);
+            for (size_t j = 0; w.ok && j < n; ++j) {
+                if (f[j] & IndexRet)
+                    continue;
+                while (next < unmatched.size() && unmatched[next] < at[j])
+                    ++next;
+                if (next == unmatched.size() || unmatched[next] != at[j])
+                    f[j] |= IndexMatched;
+            }
+            w.put(l.flags + i, f.data(), n);
+        }
+
+        return w.copy(retAddrs, l.retAddrs, 8 * records)
+                && w.copy(sizes, l.sizes, 4 * records)
+                && w.copy(threads, l.threads, 4 * records)
+                && w.copy(functions, l.functions, 4 * records)
+                && w.copy(times, l.times, 4 * records);
+    }
+
+    SpillFile offsets, retAddrs, sizes, threads, functions, times, flags;
+    uint64_t records = 0;
+};
+
+/* Writes the index of a run. The records and runs come in in input order,
+the runs get a spill of their own. */
+struct IndexWriter {
+    void record(const Batch::Entry& e) { columns.record(e); }
+
+    /* A run of lines we pass through. */
+    void run(const Passthrough::Run& r)
+    {
+        if (hasRun && last.offset + last.size + 1 == r.offset) {
+            last.size = r.offset + r.size - last.offset;
+            return;
+        }
+        close();
+        last = r;
+        hasRun = true;
+    }
+
+    /* A block starts at offset, after all the lines we got so far. */
+    void mark(uint64_t offset)
+    {
+        LineMark m = {offset, lines};
+        marks.push_back(m);
+    }
+
+    /* The run we are growing is done. */
+    void close()
+    {
+        if (!hasRun)
+            return;
+        runs.write(&last, sizeof(last));
+        ++runCount;
+        hasRun = false;
+    }
+
+    /* Put it all together in path. unmatched are the offsets of the calls
+    that never got their ret, in order. */
+    bool write(const std::string& path, const NameTable& names,
+            const std::vector<uint64_t>& unmatched, uint64_t logSize,
+            int64_t logTime)
+    {
+        close();
+
+        IndexHeader h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, "PWLINDEX", 8);
+        h.version = IndexHeader::currentVersion;
+        h.logSize = logSize;
+        h.logTime = logTime;
+        h.lines = lines;
+        h.records = columns.records;
+        h.runs = runCount;
+        h.names = names.size();
+        h.namesSize = ColumnWriter::namesSize(names);
+        h.marks = marks.size();
+        IndexLayout l(h);
+
+        ColumnWriter w;
+        if (!w.open(path, l.total))
+            return false;
+        w.put(0, &h, sizeof(h));
+        w.names(names, l);
+        w.put(l.marks, marks.data(), sizeof(LineMark) * marks.size());
+        columns.write(w, l, unmatched);
+        w.copy(runs, l.runs, sizeof(Passthrough::Run) * runCount);
+        return w.commit();
+    }
+
+    RecordColumns columns;
+    SpillFile runs;
+    uint64_t runCount = 0;
+    uint64_t lines = 0;
+    std::vector<LineMark> marks; // One per block, they are few.
+    bool hasRun = false;
+    Passthrough::Run last; // The run we are growing.
+};
+
+/* A file of columns we read, mapped, with the records in it. */
+struct RecordFile {
+    ~RecordFile()
+    {
+        if (data)
+            munmap(const_cast<char*>(data), size);
+    }
+
+    /* Map path. False if there is none, or it can't even hold its header. */
+    bool map(const std::string& path, size_t headerSize)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0)
+            return false;
+        if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(headerSize)) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = static_cast<const char*>(p);
+                size = st.st_size;
+            }
+        }
+        close(fd);
+        return data != nullptr;
+    }
+
+    /* Once the header checked out, where its records are. */
+    void point(const RecordLayout& l, uint64_t n)
+    {
+        nameCount = n;
+        nameEnds = column<uint32_t>(l.nameEnds);
+        names = data + l.names;
+        offsets = column<uint64_t>(l.offsets);
+        retAddrs = column<uint64_t>(l.retAddrs);
+        sizes = column<uint32_t>(l.sizes);
+        threads = column<uint32_t>(l.threads);
+        functions = column<uint32_t>(l.functions);
+        times = column<uint32_t>(l.times);
+        flags = column<unsigned char>(l.flags);
+    }
+
+    template <typename T>
+    const T* column(uint64_t at) const
+    {
+        return reinterpret_cast<const T*>(data + at);
+    }
+
+    Slice name(size_t i) const
+    {
+        if (i >= nameCount)
+            return Slice();
+        uint32_t begin = i ? nameEnds[i - 1] : 0;
+        return Slice(names + begin, nameEnds[i] - begin);
+    }
+
+    /* Record i, as the classifier would have made it. */
+    Batch::Entry entry(uint64_t i) const
+    {
+        Batch::Entry e;
+        e.record.threadId = threads[i];
+        e.record.function = functions[i];
+        e.record.retAddr = retAddrs[i];
+        e.record.hasRetAddr = flags[i] & IndexRetAddr;
+        e.record.hasTime = flags[i] & IndexTime;
+        e.record.time = times[i];
+        e.record.offset = offsets[i];
+        e.size = sizes[i];
+        e.text = 0;
+        e.kind = flags[i] & IndexRet ? RetLine : CallLine;
+        return e;
+    }
+
+    const char* data = nullptr;
+    size_t size = 0;
+    uint64_t nameCount = 0;
+    const uint32_t* nameEnds = nullptr;
+    const char* names = nullptr;
+    const uint64_t* offsets = nullptr;
+    const uint64_t* retAddrs = nullptr;
+    const uint32_t* sizes = nullptr;
+    const uint32_t* threads = nullptr;
+    const uint32_t* functions = nullptr;
+    const uint32_t* times = nullptr;
+    const unsigned char* flags = nullptr;
+};
+
+/* An index we read. */
+struct IndexFile : RecordFile {
+    /* False if there is none, or it isn't the index of this log anymore. */
+    bool open(const std::string& path, uint64_t logSize, int64_t logTime)
+    {
+        if (!map(path, sizeof(IndexHeader)))
+            return false;
+        header = reinterpret_cast<const IndexHeader*>(data);
+        if (std::memcmp(header->magic, "PWLINDEX", 8)
+                || header->version != IndexHeader::currentVersion
+                || header->logSize != logSize || header->logTime != logTime
+                || IndexLayout(*header).total != size)
+            return false;
+
+        IndexLayout l(*header);
+        point(l, header->names);
+        runs = column<Passthrough::Run>(l.runs);
+        marks = column<LineMark>(l.marks);
+        return true;
+    }
+
+    const IndexHeader* header = nullptr;
+    const Passthrough::Run* runs = nullptr;
+    const LineMark* marks = nullptr;
+};
+
+/* --binary, the calls of the output next to it: yourlog_parsed.txt.pwb.
+What the tools downstream would parse the text for, ready to be mapped:
+the columns of the index without the rets, the runs and the marks. A call
+either is IndexMatched or it is in the text output. */
+struct BinaryHeader {
+    static const uint32_t currentVersion = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t logSize;
+    uint64_t calls;
+    uint64_t unmatched;
+    uint64_t names;
+    uint64_t namesSize; // Bytes.
+};
+
+struct BinaryLayout : RecordLayout {
+    BinaryLayout(const BinaryHeader& h)
+    {
+        Sections s(sizeof(BinaryHeader));
+        place(s, h.names, h.namesSize, h.calls);
+        total = s.at;
+    }
+
+    uint64_t total;
+};
+
+/* Writes it, the calls only. */
+struct BinaryWriter {
+    void record(const Batch::Entry& e)
+    {
+        if (e.kind == CallLine)
+            columns.record(e);
+    }
+
+    /* unmatched are the offsets of the calls we wrote to the text, in
+    order. */
+    bool write(const std::string& path, const NameTable& names,
+            const std::vector<uint64_t>& unmatched, uint64_t logSize)
+    {
+        BinaryHeader h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, "PWLCALLS", 8);
+        h.version = BinaryHeader::currentVersion;
+        h.logSize = logSize;
+        h.calls = columns.records;
+        h.unmatched = unmatched.size();
+        h.names = names.size();
+        h.namesSize = ColumnWriter::namesSize(names);
+        BinaryLayout l(h);
+
+        ColumnWriter w;
+        if (!w.open(path, l.total))
+            return false;
+        w.put(0, &h, sizeof(h));
+        w.names(names, l);
+        columns.write(w, l, unmatched);
+        return w.commit();
+    }
+
+    RecordColumns columns;
+};
+
+/* One we read, for dump. */
+struct BinaryFile : RecordFile {
+    /* False if it isn't one, or not one we know. */
+    bool open(const std::string& path)
+    {
+        if (!map(path, sizeof(BinaryHeader)))
+            return false;
+        header = reinterpret_cast<const BinaryHeader*>(data);
+        if (std::memcmp(header->magic, "PWLCALLS", 8)
+                || header->version != BinaryHeader::currentVersion
+                || BinaryLayout(*header).total != size)
+            return false;
+        point(BinaryLayout(*header), header->names);
+        return true;
+    }
+
+    const BinaryHeader* header = nullptr;
+};
+
+/* A block of stable input, for the chunked engine. Any thread can classify
+it: it cuts the lines, parses the calls and rets and sorts them into one
+batch per thread, by the Wine thread id like the pipeline does. The lines to
+pass through are kept as runs. The main thread then hands the batches on to
+their threads in input order. */
+struct Chunk {
+    Slice text;
+    uint64_t offset = 0; // Where text starts in the input.
+    Dialect dialect = AnyDialect; // The log's.
+    std::vector<std::unique_ptr<Batch>> batches; // One per thread.
+    std::vector<Passthrough::Run> passthrough;
+    size_t lines = 0; // How many there were, for the progress.
+    bool keepRecords = false; // For the index and --binary, calls and rets in order.
+    std::vector<Batch::Entry> records;
+    std::atomic<bool> classified{false};
+    int outstanding = 0; // Batches handed on and not back yet.
+};
+
+/* The chunks waiting to be classified by one thread. The main thread
+deals them out, but a thread busy with a big batch would leave its chunk
+sitting there while the others have nothing to do, and the main thread
+waits for the oldest chunk before anything else. So a thread with nothing
+left of its own takes from the others. Everybody takes the oldest, it is
+the one holding everything up. Chunks are big, a lock per chunk is nothing,
+and count lets the others look without taking it. */
+struct ChunkQueue {
+    void push(Chunk* c)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        chunks.push_back(c);
+        count.store(chunks.size(), std::memory_order_release);
+    }
+
+    bool pop(Chunk*& c)
+    {
+        if (!count.load(std::memory_order_acquire))
+            return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (chunks.empty())
+            return false;
+        c = chunks.front();
+        chunks.pop_front();
+        count.store(chunks.size(), std::memory_order_release);
+        return true;
+    }
+
+    std::mutex mutex;
+    std::deque<Chunk*> chunks;
+    std::atomic<size_t> count{0};
+};
+
+/* Which thread owns a Wine thread id. It used to be the id modulo the
+number of threads, but Wine hands out its ids in steps of 4 (0020, 0024,
+0028...), so with 4 or 8 threads every Wine thread landed on the same one
+and the others had nothing to match. The ids are now dealt out in the order
+they show up, so as many busy Wine threads go to as many threads. Whoever
+classifies a line first deals its id, and it never moves again: a ret must
+find the stack its call was pushed on. */
+struct Shards {
+    unsigned int assign(unsigned int threadId)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = owners.find(threadId);
+        if (it == owners.end())
+            it = owners.emplace(threadId, next++ % count).first;
+        return it->second;
+    }
+
+    /* What one thread has looked up already, so the lock is only taken for
+    the ids it never saw. Ids are 16 bits in practice. */
+    struct Cache {
+        static const unsigned int none = ~0u;
+
+        unsigned int owner(Shards& shards, unsigned int threadId)
+        {
+            if (threadId > 0xffff)
+                return shards.assign(threadId);
+            if (threadId >= owners.size())
+                owners.resize(threadId + 1u, unsigned(none));
+            if (owners[threadId] == none)
+                owners[threadId] = shards.assign(threadId);
+            return owners[threadId];
+        }
+
+        std::vector<unsigned int> owners;
+    };
+
+    unsigned int count = 1; // Threads.
+    unsigned int next = 0;
+    std::unordered_map<unsigned int, unsigned int> owners;
+    std::mutex mutex;
+};
+
+/* Where the calls of a deep stack are, by function and return address.
+It is a flat hash of the newest call with each of them, and for every call
+the one before it with the same, so the newest call a ret can match is two
+lookups away: the one with its address, and the one with none at all. Calls
+only leave from the top, the newest of their kind, so a pop just puts the
+one before back. */
+struct CallIndex {
+    static const size_t none = ~size_t(0);
+
+    struct Slot {
+        unsigned int function = NameTable::unknown; // Empty.
+        bool hasRetAddr = false;
+        uint64_t retAddr = 0;
+        size_t newest = none;
+    };
+
+    void build(const std::vector<Parser>& calls)
+    {
+        size_t n = 64;
+        while (n < 4 * calls.size())
+            n *= 2;
+        slots.assign(n, Slot());
+        used = 0;
+        previous.clear();
+        for (size_t i = 0; i < calls.size(); ++i)
+            push(calls[i].Record, i);
+    }
+
+    void push(const CallRecord& call, size_t at)
+    {
+        size_t& newest = insert(call.function, call.hasRetAddr, call.retAddr);
+        previous.push_back(newest);
+        newest = at;
+    }
+
+    /* The top call goes. */
+    void pop(const CallRecord& call)
+    {
+        lookup(call.function, call.hasRetAddr, call.retAddr).newest
+                = previous.back();
+        previous.pop_back();
+    }
+
+    /* The newest call matching ret, like Parser would. */
+    size_t find(const CallRecord& ret)
+    {
+        size_t at = lookup(ret.function, false, 0).newest;
+        if (ret.hasRetAddr) {
+            size_t withAddr = lookup(ret.function, true, ret.retAddr).newest;
+            if (withAddr != none && (at == none || withAddr > at))
+                at = withAddr;
+        }
+        return at;
+    }
+
+    /* The slot of a key, or the empty one where it goes. */
+    Slot& lookup(unsigned int function, bool hasRetAddr, uint64_t retAddr)
+    {
+        uint64_t h = (retAddr ^ (uint64_t(function) << 32 | hasRetAddr))
+                * 0x9e3779b97f4a7c15ull;
+        size_t mask = slots.size() - 1;
+        for (size_t i = (h >> 32) & mask;; i = (i + 1) & mask) {
+            Slot& slot = slots[i];
+            if (slot.function == NameTable::unknown
+                    || (slot.function == function
+                            && slot.hasRetAddr == hasRetAddr
+                            && slot.retAddr == retAddr))
+                return slot;
+        }
+    }
+
+    size_t& insert(unsigned int function, bool hasRetAddr, uint64_t retAddr)
+    {
+        /* Keep it half empty. The keys whose calls are all gone are
+        dropped when it grows, they are as good as not there. */
+        if (2 * (used + 1) > slots.size()) {
+            std::vector<Slot> old(slots.size() * 2);
+            old.swap(slots);
+            used = 0;
+            for (const auto& x : old) {
+                if (x.function == NameTable::unknown || x.newest == none)
+                    continue;
+                lookup(x.function, x.hasRetAddr, x.retAddr) = x;
+                ++used;
+            }
+        }
+        Slot& slot = lookup(function, hasRetAddr, retAddr);
+        if (slot.function == NameTable::unknown) {
+            slot.function = function;
+            slot.hasRetAddr = hasRetAddr;
+            slot.retAddr = retAddr;
+            ++used;
+        }
+        return slot.newest;
+    }
+
+    std::vector<Slot> slots; // A power of 2 of them, none while not built.
+    size_t used = 0;
+    std::vector<size_t> previous; // By position in the stack.
+};
+
+/* The bottom of a call stack, on disk, for --max-mem. The oldest calls of
+a deep stack go there in bulk, and it is a stack too: they only ever come
+back off its top, when a ret matches one of them or when we are done. How
+many calls of each function and return address it holds stays in memory, so
+a ret that can't match any of them never reads it, and one that does reads
+down to its call. Everything above that is unmatched, and gone, so no call
+is read back twice. Too many different ones and we only keep a filter of
+them, see makeFilter(), then a ret it lets through reads the stack first. */
+struct SpilledStack {
+    struct Record {
+        CallRecord record;
+        uint32_t size; // Of the line.
+        uint64_t text; // Where it is in our text file, if it isn't mapped.
+        uint64_t children; // --profile, see CallStack.
+    };
+
+    struct Key {
+        unsigned int function;
+        bool hasRetAddr;
+        uint64_t retAddr;
+
+        bool operator==(const Key& o) const
+        {
+            return function == o.function && hasRetAddr == o.hasRetAddr
+                    && retAddr == o.retAddr;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& k) const
+        {
+            return (k.retAddr ^ (uint64_t(k.function) << 32 | k.hasRetAddr))
+                    * 0x9e3779b97f4a7c15ull >> 16;
+        }
+    };
+
+    SpilledStack() : records(std::tmpfile()), text(std::tmpfile()) {}
+
+    ~SpilledStack()
+    {
+        if (records)
+            std::fclose(records);
+        if (text)
+            std::fclose(text);
+    }
+
+    static Key key(const CallRecord& r)
+    {
+        Key k = {r.function, r.hasRetAddr, r.hasRetAddr ? r.retAddr : 0};
+        return k;
+    }
+
+    /* The oldest n calls of a stack go on top. from is where their lines
+    are if the input isn't mapped. The count table may take budget bytes,
+    see filter. */
+    void push(const std::vector<Parser>& calls, size_t n, const char* from,
+            const std::vector<uint64_t>& children, size_t budget)
+    {
+        /* The old top has calls above it now, what they took stays
+        with it. */
+        if (count && topChildren) {
+            Record r = read(count - 1);
+            r.children += topChildren;
+            tempFileIo(true, records, &r, sizeof(r), (count - 1) * sizeof(r));
+        }
+        topChildren = 0;
+
+        std::vector<Record> out(n);
+        std::vector<char> bytes;
+        for (size_t i = 0; i < n; ++i) {
+            Record& r = out[i];
+            r.record = calls[i].Record;
+            r.size = calls[i].Size;
+            r.text = textSize + bytes.size();
+            r.children = i < children.size() ? children[i] : 0;
+            if (from)
+                bytes.insert(bytes.end(), from + calls[i].Text,
+                        from + calls[i].Text + calls[i].Size);
+            if (filter.empty())
+                ++keys[key(r.record)];
+            else
+                ++filter[slot(key(r.record))];
+        }
+        if (filter.empty() && tableMemory() > budget)
+            makeFilter(budget);
+        if (!count)
+            bottom = calls[0].Record.offset;
+        tempFileIo(true, records, out.data(), n * sizeof(Record),
+                count * sizeof(Record));
+        if (!bytes.empty())
+            tempFileIo(true, text, bytes.data(), bytes.size(), textSize);
+        count += n;
+        textSize += bytes.size();
+    }
+
+    /* Whether a call on here would match ret, like Parser would. Only
+    maybe once we have a filter, see holds(). */
+    bool mayMatch(const CallRecord& ret) const
+    {
+        Key k = {ret.function, false, 0};
+        if (has(k))
+            return true;
+        k.hasRetAddr = true;
+        k.retAddr = ret.retAddr;
+        return ret.hasRetAddr && has(k);
+    }
+
+    bool has(const Key& k) const
+    {
+        return filter.empty() ? keys.count(k) != 0 : filter[slot(k)] != 0;
+    }
+
+    /* Whether a call on here does match ret, after mayMatch() said it may.
+    The table knows, with the filter we look, the newest first, and take
+    nothing off. */
+    bool holds(const CallRecord& ret)
+    {
+        if (filter.empty())
+            return true;
+        std::vector<Record> block(4096);
+        for (uint64_t end = count; end;) {
+            uint64_t n = std::min<uint64_t>(block.size(), end);
+            end -= n;
+            tempFileIo(false, records, block.data(), n * sizeof(Record),
+                    end * sizeof(Record));
+            for (uint64_t i = n; i-- > 0;) {
+                if (Parser(block[i].record, block[i].size, 0)(ret))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    /* The table is exact, but a node per function and return address on
+    here. A thread with a lot of different ones that never returns makes it
+    as big as what we spilled. Past its budget it becomes a counting hash
+    of that size instead, a counter per slot of keys. Those share slots, so
+    it can say a call is here when it isn't, never that it isn't when it
+    is. */
+    void makeFilter(size_t budget)
+    {
+        size_t slots = 1024;
+        while (slots * 2 * sizeof(uint32_t) <= budget)
+            slots *= 2;
+        filter.assign(slots, 0);
+        for (const auto& x : keys)
+            filter[slot(x.first)] += x.second;
+        std::unordered_map<Key, uint64_t, KeyHash>().swap(keys);
+    }
+
+    size_t slot(const Key& k) const { return KeyHash()(k) & (filter.size() - 1); }
+
+    /* What the count table takes, roughly: a node and a bucket per key. */
+    size_t tableMemory() const
+    {
+        return keys.size() * (sizeof(std::pair<const Key, uint64_t>)
+                + 2 * sizeof(void*)) + keys.bucket_count() * sizeof(void*)
+                + filter.capacity() * sizeof(uint32_t);
+    }
+
+    /* The top call comes off. */
+    Record pop()
+    {
+        Record r = read(--count);
+        r.children += topChildren;
+        topChildren = 0;
+        textSize = r.text;
+        if (!filter.empty()) {
+            --filter[slot(key(r.record))];
+            return r;
+        }
+        auto it = keys.find(key(r.record));
+        if (!--it->second)
+            keys.erase(it);
+        return r;
+    }
+
+    Record read(uint64_t i)
+    {
+        Record r;
+        tempFileIo(false, records, &r, sizeof(r), i * sizeof(r));
+        return r;
+    }
+
+    /* The line of a record goes to the end of to. */
+    void readText(const Record& r, std::vector<char>& to)
+    {
+        to.resize(to.size() + r.size);
+        tempFileIo(false, text, &to[to.size() - r.size], r.size, r.text);
+    }
+
+    std::FILE* records;
+    std::FILE* text;
+    uint64_t count = 0;
+    uint64_t textSize = 0;
+    uint64_t bottom = 0; // Offset of the oldest call, for the watermark.
+    uint64_t topChildren = 0; // Taken by the calls above the top since it became it.
+    std::unordered_map<Key, uint64_t, KeyHash> keys; // How many calls of each.
+    std::vector<uint32_t> filter; // Or of each slot, once keys got too big.
+};
+
+/* The pending calls of a Wine thread. Calls only ever leave from the top,
+so when the input isn't mapped their lines are kept on a stack of bytes
+right next to them: a push appends, a pop just cuts it back. Nothing is
+shifted and nothing is allocated per call. */
+struct CallStack {
+    /* A ret that misses the top looks further down, the newest call first.
+    A few calls deep that is quicker than anything. But a thread whose rets
+    get lost never pops, its stack only grows, and every lost ret looked at
+    all of it again. Past indexDepth calls the stack keeps a CallIndex, and
+    drops it again once it is back to a few. */
+    static const size_t indexDepth = 64;
+    static const size_t none = CallIndex::none;
+
+    void push(const Parser& call)
+    {
+        calls.push_back(call);
+        if (!index.slots.empty())
+            index.push(call.Record, calls.size() - 1);
+    }
+
+    /* The oldest n calls go to disk, --max-mem. What they leave in memory
+    may take budget bytes. */
+    void spill(size_t n, bool mapped, size_t budget)
+    {
+        if (!spilled)
+            spilled.reset(new SpilledStack());
+        spilled->push(calls, n, mapped ? nullptr : text.data(), children,
+                budget);
+        if (!mapped) {
+            uint64_t cut = n < calls.size() ? calls[n].Text : text.size();
+            text.erase(text.begin(), text.begin() + cut);
+            text.shrink_to_fit();
+            for (size_t i = n; i < calls.size(); ++i)
+                calls[i].Text -= cut;
+        }
+        calls.erase(calls.begin(), calls.begin() + n);
+        calls.shrink_to_fit();
+        children.erase(children.begin(),
+                children.begin() + std::min(n, children.size()));
+        children.shrink_to_fit();
+        index = CallIndex(); // Everybody moved.
+    }
+
+    /* What we hold in memory, roughly. */
+    size_t memory() const
+    {
+        return calls.capacity() * sizeof(Parser) + text.capacity()
+                + children.capacity() * sizeof(uint64_t)
+                + index.slots.capacity() * sizeof(CallIndex::Slot)
+                + index.previous.capacity() * sizeof(size_t)
+                + (spilled ? spilled->tableMemory() : 0);
+    }
+
+    /* With the ones on disk. */
+    size_t depth() const
+    {
+        return calls.size() + (spilled ? spilled->count : 0);
+    }
+
+    /* Drop the calls from i up. */
+    void cut(size_t i, bool mapped)
+    {
+        if (!mapped)
+            text.resize(calls[i].Text);
+        if (!index.slots.empty()) {
+            for (size_t j = calls.size(); j-- > i;)
+                index.pop(calls[j].Record);
+            if (i < indexDepth / 4)
+                index = CallIndex();
+        }
+        calls.erase(calls.begin() + i, calls.end());
+        children.resize(std::min(children.size(), i));
+    }
+
+    /* The newest call below the top that ret matches, or none. Not the
+    ones on disk. */
+    size_t below(const CallRecord& ret)
+    {
+        if (calls.empty())
+            return none;
+        if (index.slots.empty()) {
+            if (calls.size() <= indexDepth) {
+                for (size_t i = calls.size() - 1; i-- > 0;) {
+                    if (calls[i](ret))
+                        return i;
+                }
+                return none;
+            }
+            index.build(calls);
+        }
+        return index.find(ret); // Not the top, that one didn't match.
+    }
+
+    std::vector<Parser> calls; // Oldest first.
+    std::vector<char> text; // Their lines, if the input isn't mapped.
+
+    /* --profile, next to calls: the time spent in the matched calls right
+    above each of them, what isn't their own. */
+    std::vector<uint64_t> children;
+    CallIndex index; // Only on deep stacks.
+    std::unique_ptr<SpilledStack> spilled; // Our oldest calls, --max-mem.
+    size_t maxDepth = 0; // For --stats.
+    uint64_t pushed = 0; // Calls, for --summary.
+    uint64_t unmatched = 0; // The ones we know will never be matched.
+};
+
+/* What --summary tells about a function. */
+struct FunctionCounts {
+    uint64_t calls = 0;
+    uint64_t unmatched = 0;
+    size_t maxDepth = 0; // Deepest it was called, on any stack.
+
+    /* And --profile, in milliseconds. Only the calls matched with a
+    timestamp on both lines count. A recursive function counts the calls
+    inside itself again in inclusive. */
+    uint64_t timed = 0;
+    uint64_t inclusive = 0; // Call to ret.
+    uint64_t exclusive = 0; // Without the calls it made.
+    uint32_t longest = 0;
+
+    void add(const FunctionCounts& o)
+    {
+        calls += o.calls;
+        unmatched += o.unmatched;
+        maxDepth = std::max(maxDepth, o.maxDepth);
+        timed += o.timed;
+        inclusive += o.inclusive;
+        exclusive += o.exclusive;
+        longest = std::max(longest, o.longest);
+    }
+};
+
+/* The first line of a little file, like the ones in /proc and /sys. Empty
+if it isn't there. */
+std::string firstLine(const std::string& path)
+{
+    std::string line;
+    if (std::FILE* f = std::fopen(path.c_str(), "r")) {
+        char buffer[4096];
+        if (std::fgets(buffer, sizeof(buffer), f))
+            line = buffer;
+        std::fclose(f);
+    }
+    return line;
+}
+
+/* How many CPUs the cgroup lets us keep busy, 0 if it doesn't say. A
+container with 150000 us every 100000 gets 2. */
+unsigned int cgroupCpus()
+{
+    long long quota = -1;
+    long long period = 0;
+    std::string max = firstLine("/sys/fs/cgroup/cpu.max"); // cgroup v2.
+    if (!max.empty()) {
+        quota = max.compare(0, 3, "max") ? std::strtoll(max.c_str(), nullptr, 10)
+                : -1;
+        period = std::strtoll(max.c_str() + max.find(' ') + 1, nullptr, 10);
+    } else { // v1
+        std::string q = firstLine("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::string p = firstLine("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        if (!q.empty() && !p.empty()) {
+            quota = std::strtoll(q.c_str(), nullptr, 10);
+            period = std::strtoll(p.c_str(), nullptr, 10);
+        }
+    }
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return static_cast<unsigned int>((quota + period - 1) / period);
+}
+
+/* The CPUs our affinity mask lets us run on, taskset and cpusets say. */
+std::vector<int> allowedCpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &set))
+                cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+/* How many CPUs we may keep busy: the ones we are allowed on, and no more
+than the quota. hardware_concurrency() if the mask says nothing, and it can
+say 0 too. At least one. */
+unsigned int cpuCount()
+{
+    unsigned int n = allowedCpus().size();
+    if (!n)
+        n = std::thread::hardware_concurrency();
+    unsigned int quota = cgroupCpus();
+    if (quota && quota < n)
+        n = quota;
+    return std::max(1u, n);
+}
+
+/* The allowed CPUs in the order --pin hands them out: the one we are on
+first, then the rest of our NUMA node, then the other nodes. The threads
+fill the socket the main thread is on before they go across. */
+std::vector<int> pinOrder()
+{
+    std::vector<int> cpus = allowedCpus();
+    std::vector<int> nodes(CPU_SETSIZE, 0); // One node if sysfs says nothing.
+    if (DIR* dir = opendir("/sys/devices/system/node")) {
+        while (dirent* e = readdir(dir)) {
+            if (std::strncmp(e->d_name, "node", 4) || !std::isdigit(e->d_name[4]))
+                continue;
+            int node = std::atoi(e->d_name + 4);
+            /* Like 0-7,16-23. */
+            std::string list = firstLine(std::string("/sys/devices/system/node/")
+                    + e->d_name + "/cpulist");
+            for (const char* p = list.c_str(); std::isdigit(*p);) {
+                char* end;
+                long first = std::strtol(p, &end, 10);
+                long last = *end == '-' ? std::strtol(end + 1, &end, 10) : first;
+                for (long i = first; i <= last && i < CPU_SETSIZE; ++i)
+                    nodes[i] = node;
+                p = *end == ',' ? end + 1 : end;
+            }
+        }
+        closedir(dir);
+    }
+
+    int here = sched_getcpu();
+    int ours = here >= 0 && here < CPU_SETSIZE ? nodes[here] : 0;
+    std::stable_sort(cpus.begin(), cpus.end(), [&](int a, int b) {
+        return std::make_tuple(a != here, nodes[a] != ours, nodes[a])
+                < std::make_tuple(b != here, nodes[b] != ours, nodes[b]);
+    });
+    return cpus;
+}
+
+/* Keep the calling thread on one CPU. Linux puts the memory a thread
+touches first on the node it runs on, so a thread pinned before it builds
+its stacks has them on its own node. */
+void pinTo(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* The actual thread. This guy contains a stack of work functors for every
+Wine thread id it owns. Here we are parsing strings. I couldn't use a vector
+of std::function as I need to store a parameter inside, and later process
+that. A function object seemed more appropriate. */
+struct Thread {
+    static const size_t maxBatches = 16; // In flight, per thread.
+
+    /* WARING: If you have other member assignements, the thread
+    construction would be in another method, and called AFTER the
+    constructor. Remember that constructor initialization order is NOT
+    guaranteed! */
+    Thread(Doorbell& main, const char* m, NameTable& n, const Filter& f,
+            Shards& s, std::vector<std::unique_ptr<ChunkQueue>>& q, size_t i,
+            int c)
+        : mainBell(main)
+        , mapping(m)
+        , names(n)
+        , filter(f)
+        , shards(s)
+        , queues(q)
+        , me(i)
+        , cpu(c)
+        , input(2 * maxBatches)
+        , done(2 * maxBatches)
+    {
+        myThread = std::thread(&Thread::run, this);
+    }
+
+    /* If this is called before the thread is done, your software will hang. */
+    ~Thread()
+    {
+        if (myThread.joinable())
+            myThread.join();
+    }
+
+    /* This is our working state: wait for a batch, do work, hand it back,
+    rince repeat. A null batch means we are done. Batches go before chunks
+    to classify: our stacks only move forward one batch at a time, the
+    chunks can be done by anybody. Ours first, then somebody else's. */
+    void run()
+    {
+        if (cpu >= 0)
+            pinTo(cpu); // Before we allocate anything.
+        while (true) {
+            Batch* b = nullptr;
+            Chunk* c = nullptr;
+            {
+                StageTimer timer(stats.waitTime);
+                bell.wait([&] { return input.pop(b) || takeChunk(c); });
+            }
+            if (c) {
+                classify(*c);
+                c->classified.store(true, std::memory_order_release);
+                mainBell.ring();
+                continue;
+            }
+            if (!b)
+                break;
+
+            process(*b);
+
+            done.push(b); // Can't be full, there aren't that many batches.
+            mainBell.ring();
+        }
+    }
+
+    bool takeChunk(Chunk*& c)
+    {
+        if (queues[me]->pop(c))
+            return true;
+        for (size_t i = 1; i < queues.size(); ++i) {
+            if (queues[(me + i) % queues.size()]->pop(c)) {
+                ++stats.stolen;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Cut a chunk in lines, and sort them out for the threads. */
+    void classify(Chunk& c)
+    {
+        StageTimer timer(stats.classifyTime);
+        scanLines(c.text, c.offset, lines, c.dialect);
+        stats.bytes += c.text.size;
+        stats.lines += lines.size();
+        for (const auto& line : lines) {
+            if (line.kind == OtherLine) {
+                Passthrough::Run r = {line.offset, line.text.size};
+                if (!c.passthrough.empty()
+                        && c.passthrough.back().offset
+                                + c.passthrough.back().size + 1 == r.offset)
+                    c.passthrough.back().size = r.offset + r.size
+                            - c.passthrough.back().offset;
+                else
+                    c.passthrough.push_back(r);
+                continue;
+            }
+
+            /* Rets are interned too. Their call may be in a chunk another
+            thread is still busy with, so we can't tell it is unknown. */
+            unsigned int function = intern(parseFunction(line));
+            if (function == NameTable::unknown) {
+                ++stats.filtered;
+                continue;
+            }
+            Batch::Entry e = makeEntry(line);
+            e.record.function = function;
+            c.batches[shardCache.owner(shards, line.threadId)]->entries
+                    .push_back(e);
+            if (c.keepRecords)
+                c.records.push_back(e);
+        }
+        for (auto& b : c.batches)
+            b->end = c.offset + c.text.size;
+        c.lines = lines.size();
+    }
+
+    /* The id of a function name, from our cache if we can. The cache has
+    ids of its own, cacheIds turns them into the shared ones. The names the
+    filter drops are unknown, they never make it to the shared table. */
+    unsigned int intern(const Slice& name)
+    {
+        unsigned int id = nameCache.intern(name);
+        if (id == cacheIds.size())
+            cacheIds.push_back(filter.keep(name) ? names.internShared(name)
+                    : NameTable::unknown);
+        return cacheIds[id];
+    }
+
+    /* Push the calls on the stack of their Wine thread, match the rets. */
+    void process(Batch& b)
+    {
+        StageTimer timer(stats.matchTime);
+        ++stats.batches;
+        for (const auto& e : b.entries) {
+            if (e.kind == RetLine) {
+                ++stats.rets;
+                match(e.record, b);
+                continue;
+            }
+
+            /* Create a function object, its line stays in the mapping or
+            goes on top of the copies of its stack. */
+            CallStack& stack = callStacks[e.record.threadId];
+            Parser call(e.record, e.size, e.record.offset);
+            if (!mapping) {
+                call.Text = e.text;
+                call.moveText(b.text.data(), stack.text);
+            }
+            stack.push(call);
+            if (profileCalls)
+                stack.children.push_back(0);
+            size_t depth = stack.depth();
+            stack.maxDepth = std::max(stack.maxDepth, depth);
+            ++stack.pushed;
+            FunctionCounts& f = counts(e.record.function);
+            ++f.calls;
+            f.maxDepth = std::max(f.maxDepth, depth);
+            ++pending;
+            ++stats.calls;
+        }
+        if (memoryLimit)
+            spill();
+
+        b.oldest = oldest();
+        b.pending = pending;
+    }
+
+    /* --max-mem: our stacks hold more than we may. The oldest calls of the
+    deepest ones go to disk, until we are down to half of it. The newest
+    quarter of a stack stays, that is where nearly all the rets go. Shallow
+    stacks aren't worth it. */
+    void spill()
+    {
+        static const size_t minimum = 256; // Calls, to bother.
+
+        size_t held = 0;
+        std::vector<CallStack*> stacks;
+        for (auto& x : callStacks) {
+            held += x.second.memory();
+            stacks.push_back(&x.second);
+        }
+        if (held <= memoryLimit)
+            return;
+        std::sort(stacks.begin(), stacks.end(),
+                [](const CallStack* a, const CallStack* b) {
+                    return a->calls.size() > b->calls.size();
+                });
+        for (CallStack* stack : stacks) {
+            size_t n = stack->calls.size() - stack->calls.size() / 4;
+            if (held <= memoryLimit / 2 || n < minimum)
+                break;
+            held -= stack->memory();
+            stack->spill(n, mapping, memoryLimit / 8);
+            held += stack->memory();
+            stats.spilled += n;
+        }
+    }
+
+    /* Match a ret against the stack of its Wine thread. Calls nest, so the
+    ret nearly always belongs to the call on top of the stack. When it
+    doesn't (broken nesting, lost lines), fall back to the rest of that
+    stack, the newest call with the same function and return address, see
+    CallStack::below(). If it matches down there, the calls above it will
+    never see their ret: they are unmatched, and can go to the output right
+    away. */
+    void match(const CallRecord& ret, Batch& b)
+    {
+        auto it = callStacks.find(ret.threadId);
+        if (it == callStacks.end() || !it->second.depth()) {
+            ++stats.lostRets;
+            return;
+        }
+
+        CallStack& stack = it->second;
+        std::vector<Parser>& calls = stack.calls;
+        if (!calls.empty() && calls.back()(ret)) {
+            if (profileCalls)
+                charge(stack, calls.size() - 1, ret);
+            stack.cut(calls.size() - 1, mapping);
+            --pending;
+            ++stats.fastMatches;
+            return;
+        }
+
+        /* Same function and return address, just not where we expected
+        it. */
+        size_t i = stack.below(ret);
+        if (i == CallStack::none) {
+            if (!matchSpilled(stack, ret, b))
+                ++stats.lostRets;
+            return;
+        }
+
+        /* We know that we only have to match 1 call. */
+        for (auto j = i + 1; j < calls.size(); ++j) {
+            ++counts(calls[j].Record.function).unmatched;
+            b.unmatched.push_back(calls[j]);
+            if (!mapping)
+                b.unmatched.back().moveText(stack.text.data(), b.unmatchedText);
+        }
+        if (profileCalls)
+            charge(stack, i, ret);
+        pending -= calls.size() - i;
+        stack.unmatched += calls.size() - i - 1;
+        stack.cut(i, mapping);
+        ++stats.fallbackMatches;
+    }
+
+    /* Nothing in memory matched ret, the calls on disk are older still.
+    If one of them does, everything above it is unmatched: all of what is in
+    memory, and what is on disk above it. */
+    bool matchSpilled(CallStack& stack, const CallRecord& ret, Batch& b)
+    {
+        SpilledStack* spilled = stack.spilled.get();
+        if (!spilled || !spilled->mayMatch(ret) || !spilled->holds(ret))
+            return false;
+
+        std::vector<Parser>& calls = stack.calls;
+        for (const auto& call : calls) {
+            ++counts(call.Record.function).unmatched;
+            b.unmatched.push_back(call);
+            if (!mapping)
+                b.unmatched.back().moveText(stack.text.data(), b.unmatchedText);
+        }
+        uint64_t above = calls.size();
+        if (!calls.empty())
+            stack.cut(0, mapping);
+
+        while (true) { // mayMatch() says it is down there.
+            SpilledStack::Record r = spilled->pop();
+            Parser call(r.record, r.size, 0);
+            if (call(ret)) {
+                uint64_t took;
+                if (profileCalls && charge(r.record, r.children, ret, took))
+                    spilled->topChildren += took;
+                break;
+            }
+            ++counts(r.record.function).unmatched;
+            if (!mapping) {
+                call.Text = b.unmatchedText.size();
+                spilled->readText(r, b.unmatchedText);
+            } else {
+                call.Text = r.record.offset;
+            }
+            b.unmatched.push_back(call);
+            ++above;
+        }
+        pending -= above + 1;
+        stack.unmatched += above;
+        ++stats.fallbackMatches;
+        if (!spilled->count)
+            stack.spilled.reset();
+        return true;
+    }
+
+    /* --profile, the call at i of stack got its ret. What it took goes to
+    its function, and to its caller as the time of its children. The tick
+    count is 32 bits, the difference still works when it wraps. */
+    void charge(CallStack& stack, size_t i, const CallRecord& ret)
+    {
+        uint64_t took;
+        if (!charge(stack.calls[i].Record, stack.children[i], ret, took))
+            return;
+        if (i)
+            stack.children[i - 1] += took;
+        else if (stack.spilled)
+            stack.spilled->topChildren += took; // Our caller is on disk.
+    }
+
+    /* Same for a call, wherever it is, children is what the calls right
+    above it took. False if there is no time to go by. */
+    bool charge(const CallRecord& call, uint64_t children, const CallRecord& ret,
+            uint64_t& took)
+    {
+        if (!call.hasTime || !ret.hasTime)
+            return false;
+        uint32_t t = ret.time - call.time;
+        FunctionCounts& f = counts(call.function);
+        ++f.timed;
+        f.inclusive += t;
+        f.exclusive += t - std::min<uint64_t>(t, children);
+        f.longest = std::max(f.longest, t);
+        took = t;
+        return true;
+    }
+
+    /* The counters of a function, by id. */
+    FunctionCounts& counts(unsigned int function)
+    {
+        if (function >= functions.size())
+            functions.resize(function + 1);
+        return functions[function];
+    }
+
+    /* Offset of our oldest call still waiting for its ret. */
+    uint64_t oldest() const
+    {
+        uint64_t ret = std::numeric_limits<uint64_t>::max();
+        for (const auto& x : callStacks) {
+            if (x.second.spilled)
+                ret = std::min(ret, x.second.spilled->bottom);
+            else if (!x.second.calls.empty())
+                ret = std::min(ret, x.second.calls[0].Record.offset);
+        }
+        return ret;
+    }
+
+    Doorbell bell; // Rung when there is a new batch.
+    Doorbell& mainBell; // We ring it when a batch is done.
+    const char* mapping; // The input, if it is mapped.
+    NameTable& names; // Shared by everybody.
+    const Filter& filter;
+    Shards& shards; // Who owns which Wine thread, shared by everybody.
+    std::vector<std::unique_ptr<ChunkQueue>>& queues; // Everybody's chunks.
+    size_t me; // Our queue.
+    int cpu; // Where --pin keeps us, -1 anywhere.
+    Ring<Batch*> input; // Batches to process.
+    Ring<Batch*> done; // Batches processed.
+    int pending = 0; // Calls left in all our stacks.
+    size_t memoryLimit = 0; // For our stacks, --max-mem. 0 is no limit.
+    Stats stats; // Ours, read once we are done.
+    std::vector<FunctionCounts> functions; // By function id, for --summary.
+    std::thread myThread; // Our thread.
+
+    /* One LIFO stack of pending calls per Wine thread id. We still store the
+    functors contiguously in a vector, as this will REALLY improve the
+    performance. No Pointers Allowed. */
+    std::unordered_map<unsigned int, CallStack> callStacks;
+
+    /* For classify(). */
+    std::vector<Line> lines;
+    NameTable nameCache;
+    std::vector<unsigned int> cacheIds;
+    Shards::Cache shardCache;
+
+    /* Only the main thread touches these. */
+    std::vector<std::unique_ptr<Batch>> batches; // All the batches we have.
+    std::vector<Batch*> freeBatches;
+    Batch* open = nullptr; // The batch being filled.
+    int inFlight = 0; // Batches handed over and not back yet.
+    uint64_t oldestSeen = std::numeric_limits<uint64_t>::max();
+    uint64_t processedUpTo = 0; // end of the last batch that came back.
+    int pendingSeen = 0;
+};
+
+/* This is the thread pool. It will contain as many threads as your processor
+supports - 1, since we also have the main thread.
+It uses a vector of the thread objects, will enqueue work to the thread that
+owns the Wine thread id of the line, and has a few utility methods like
+finish and size.
+The work is a pipeline: the main thread reads and parses the lines, fills
+batches and hands them to the threads through lock-free rings. The threads
+match, and hand the batches back with the calls that turned out unmatched.
+When the input stays put, the chunked engine takes the reading and parsing
+off the main thread too, see parseChunks().
+The output is tailored to this specific software, and should be rewritten if
+you use this. */
+struct ThreadPool {
+    ThreadPool(const char* m, const Filter& f, unsigned int threads = 0,
+            bool pin = false)
+        : mapping(m)
+        , filter(f)
+    {
+        /* Ask kingly how many CPUs we may use, the main thread takes one.
+        On a single core we still need one. */
+        unsigned int numThreads = threads ? threads
+                : std::max(2u, cpuCount()) - 1;
+
+        /* --pin: the main thread stays where it is, the threads go on the
+        CPUs after it. More threads than CPUs share them evenly. */
+        std::vector<int> cpus;
+        if (pin)
+            cpus = pinOrder();
+        if (!cpus.empty())
+            pinTo(cpus[0]);
+        /* Everything the threads share is there before they start. */
+        shards.count = numThreads;
+        for (auto i = 0u; i < numThreads; ++i)
+            queues.emplace_back(new ChunkQueue());
+        /* Create the thread objects. Emplace them in the vector. */
+        for (auto i = 0u; i < numThreads; ++i) {
+            int cpu = cpus.empty() ? -1 : cpus[(i + 1) % cpus.size()];
+            pool.emplace_back(new Thread(bell, mapping, names, filter, shards,
+                    queues, i, cpu));
+        }
+    }
+
+    /* The chunked engine. The threads classify whole blocks of the input,
+    as many at once as we have chunks, so the main thread only hands out
+    work. Each block's batches are then handed on to their threads in input
+    order. There is nothing to stitch at the block boundaries: a thread's
+    stacks carry over from one block to the next, so a call with its ret in
+    a later block matches like any other. */
+    void parseChunks(InputReader& in, OutputSink& os, ReorderWindow& window,
+            Progress& progress)
+    {
+        size_t count = std::min(2 * pool.size(), Thread::maxBatches);
+        for (size_t i = 0; i < count; ++i) {
+            chunks.emplace_back(new Chunk());
+            Chunk& c = *chunks.back();
+            c.keepRecords = index != nullptr || binary != nullptr;
+            for (size_t j = 0; j < pool.size(); ++j) {
+                c.batches.emplace_back(new Batch());
+                c.batches.back()->chunk = &c;
+            }
+            freeChunks.push_back(&c);
+        }
+
+        std::deque<Chunk*> queue; // Handed out, in input order.
+        size_t next = 0; // Who classifies the next one, if nobody sleeps.
+        bool more = true;
+        while (true) {
+            /* Keep every free chunk busy. */
+            while (more && !freeChunks.empty()) {
+                Chunk* c = freeChunks.back();
+                c->offset = in.offset();
+                bool got;
+                {
+                    StageTimer timer(stats.readTime);
+                    got = in.getBlock(c->text);
+                }
+                if (!got) {
+                    more = false;
+                    break;
+                }
+                freeChunks.pop_back();
+                if (!c->offset)
+                    dialect = sniffDialect(c->text);
+                c->dialect = dialect;
+                c->classified.store(false, std::memory_order_relaxed);
+                /* A thread that sleeps has nothing to do, wake it up. The
+                others will get to it, or steal it, when they are done. */
+                size_t i = 0;
+                while (i < pool.size() && !pool[i]->bell.sleeping.load())
+                    ++i;
+                if (i == pool.size())
+                    i = next++ % pool.size();
+                queues[i]->push(c);
+                pool[i]->bell.ring();
+                queue.push_back(c);
+            }
+
+            /* All chunks are still with the threads, wait for some back. */
+            if (queue.empty()) {
+                if (!more)
+                    break;
+                {
+                    StageTimer timer(stats.waitTime);
+                    bell.wait([&] { return done(); });
+                }
+                collect();
+                continue;
+            }
+
+            /* The oldest one, its batches go on to the threads. */
+            Chunk* c = queue.front();
+            {
+                StageTimer timer(stats.waitTime);
+                bell.wait([&] {
+                    return c->classified.load(std::memory_order_acquire);
+                });
+            }
+            queue.pop_front();
+            for (size_t i = 0; i < pool.size(); ++i) {
+                Batch* b = c->batches[i].get();
+                if (b->entries.empty())
+                    continue;
+                ++c->outstanding;
+                handOver(*pool[i], b);
+            }
+            if (!summary) {
+                for (const auto& r : c->passthrough)
+                    window.passthrough.add(r);
+            }
+            for (const auto& e : c->records) {
+                if (index)
+                    index->record(e);
+                if (binary)
+                    binary->record(e);
+            }
+            c->records.clear();
+            if (index) {
+                for (const auto& r : c->passthrough)
+                    index->run(r);
+                index->mark(c->offset);
+                index->lines += c->lines;
+            }
+            c->passthrough.clear();
+            if (!c->outstanding)
+                freeChunks.push_back(c);
+
+            flush(os, window, c->offset + c->text.size);
+
+            progress.add(c->text.size, c->lines);
+        }
+    }
+
+    /* Hand every batch being filled over, and write everything that is
+    final. Every line we kept knows its offset in the input, the oldest call
+    that may still be pending in any of the threads tells us how far we can
+    go. */
+    void flush(OutputSink& os, ReorderWindow& window, uint64_t end)
+    {
+        for (const auto& t : pool) {
+            if (t->open)
+                submit(*t, end);
+        }
+        collect();
+
+        /* --summary only counts them, the threads already did. */
+        for (auto& x : unmatched) {
+            if (!summary)
+                window.unmatched(x, unmatchedText.data());
+        }
+        unmatched.clear();
+        unmatchedText.clear();
+
+        uint64_t watermark = std::numeric_limits<uint64_t>::max();
+        for (const auto& t : pool) {
+            watermark = std::min(watermark, t->oldestSeen);
+            /* The batches it hasn't given back could still hold calls,
+            they are all past what it processed. */
+            if (t->inFlight)
+                watermark = std::min(watermark, t->processedUpTo);
+        }
+        stats.maxPending = std::max<uint64_t>(stats.maxPending, size());
+        StageTimer timer(stats.outputTime);
+        window.flush(os, watermark);
+    }
+
+    /* Our final output method. Whatever is left in the stacks was never
+    matched. */
+    void write(OutputSink& os, ReorderWindow& window)
+    {
+        for (const auto& t : pool) {
+            for (auto& x : t->callStacks) {
+                for (auto& call : x.second.calls)
+                    window.unmatched(call, x.second.text.data());
+                forEachSpilled(x.second, [&](Parser& call, const char* text) {
+                    window.unmatched(call, text);
+                });
+                x.second = CallStack();
+            }
+            t->pending = 0;
+            t->oldestSeen = std::numeric_limits<uint64_t>::max();
+        }
+        flush(os, window, std::numeric_limits<uint64_t>::max());
+    }
+
+    /* Hand over what is left, tell the threads to stop and wait for them
+    to be done. Then their stacks are ours. */
+    void finish()
+    {
+        for (const auto& t : pool) {
+            if (t->open)
+                submit(*t, std::numeric_limits<uint64_t>::max());
+            t->input.push(nullptr); // Notify the thread it is done, pat on back.
+            t->bell.ring();
+        }
+
+        for (const auto& t : pool) {
+            if (t->myThread.joinable())
+                t->myThread.join();
+        }
+        collect();
+
+        /* The threads are gone, their stats are ours. */
+        threadStats.clear();
+        depths.clear();
+        for (const auto& t : pool) {
+            threadStats.push_back(t->stats);
+            for (const auto& x : t->callStacks)
+                depths.push_back(std::make_pair(x.first, x.second.maxDepth));
+        }
+    }
+
+    /* --summary, once we are done. The threads counted for themselves, the
+    totals are the sum of theirs. What is left in the stacks was never
+    matched. */
+    void summarize()
+    {
+        functions.clear();
+        wineThreads.clear();
+        for (const auto& t : pool) {
+            if (functions.size() < t->functions.size())
+                functions.resize(t->functions.size());
+            for (size_t i = 0; i < t->functions.size(); ++i)
+                functions[i].add(t->functions[i]);
+
+            for (auto& x : t->callStacks) {
+                for (const auto& call : x.second.calls)
+                    ++functions[call.Record.function].unmatched;
+                forEachSpilled(x.second, [&](Parser& call, const char*) {
+                    ++functions[call.Record.function].unmatched;
+                });
+                WineThread w;
+                w.id = x.first;
+                w.calls = x.second.pushed;
+                w.unmatched = x.second.unmatched + x.second.depth();
+                w.maxDepth = x.second.maxDepth;
+                wineThreads.push_back(w);
+            }
+        }
+        std::sort(wineThreads.begin(), wineThreads.end(),
+                [](const WineThread& a, const WineThread& b) {
+                    return a.id < b.id;
+                });
+    }
+
+    /* The calls a stack has on disk, with their lines if the input isn't
+    mapped, bottom up. Once we are done. */
+    template <typename F>
+    void forEachSpilled(CallStack& stack, F f)
+    {
+        if (!stack.spilled)
+            return;
+        std::vector<char> text;
+        for (uint64_t i = 0; i < stack.spilled->count; ++i) {
+            SpilledStack::Record r = stack.spilled->read(i);
+            Parser call(r.record, r.size, mapping ? r.record.offset : 0);
+            text.clear();
+            if (!mapping)
+                stack.spilled->readText(r, text);
+            f(call, text.data());
+        }
+    }
+
+    /* --max-mem, what the stacks of every thread may hold. */
+    void limitMemory(size_t bytes)
+    {
+        for (const auto& t : pool)
+            t->memoryLimit = std::max<size_t>(1, bytes / pool.size());
+    }
+
+    /* Every Wine thread id always goes to the same thread, so a ret only
+    ever has to look at the stack its call was pushed on. See Shards. */
+    Thread& owner(unsigned int threadId)
+    {
+        return *pool[shardCache.owner(shards, threadId)];
+    }
+
+    /* The batch being filled for a thread. If it already has all its
+    batches in flight, wait for one to come back. */
+    Batch& openBatch(Thread& t)
+    {
+        while (!t.open) {
+            if (!t.freeBatches.empty()) {
+                t.open = t.freeBatches.back();
+                t.freeBatches.pop_back();
+            } else if (t.batches.size() < Thread::maxBatches) {
+                t.batches.emplace_back(new Batch());
+                t.open = t.batches.back().get();
+            } else {
+                {
+                    StageTimer timer(stats.waitTime);
+                    bell.wait([&] { return !t.done.empty(); });
+                }
+                collect();
+            }
+        }
+        return *t.open;
+    }
+
+    /* Hand the batch being filled over to its thread. */
+    void submit(Thread& t, uint64_t end)
+    {
+        t.open->end = end;
+        handOver(t, t.open);
+        t.open = nullptr;
+    }
+
+    void handOver(Thread& t, Batch* b)
+    {
+        t.input.push(b); // Can't be full either.
+        t.bell.ring(); // Get to work!
+        ++t.inFlight;
+    }
+
+    /* Whether a thread has batches for us. */
+    bool done() const
+    {
+        for (const auto& t : pool) {
+            if (!t->done.empty())
+                return true;
+        }
+        return false;
+    }
+
+    /* Take back the batches the threads are done with, and their results. */
+    void collect()
+    {
+        for (const auto& t : pool) {
+            Batch* b;
+            while (t->done.pop(b)) {
+                for (auto& x : b->unmatched) {
+                    unmatched.push_back(x);
+                    if (!mapping)
+                        unmatched.back().moveText(b->unmatchedText.data(),
+                                unmatchedText);
+                }
+                t->oldestSeen = b->oldest;
+                t->processedUpTo = b->end;
+                t->pendingSeen = b->pending;
+                --t->inFlight;
+                b->clear();
+                if (!b->chunk)
+                    t->freeBatches.push_back(b);
+                else if (!--b->chunk->outstanding)
+                    freeChunks.push_back(b->chunk);
+            }
+        }
+    }
+
+    /* This is where we add work. The call is parsed once, and goes in the
+    batch of the thread owning its Wine thread. The line is copied if it
+    won't outlive the reader's next block. */
+    void enqueue(const Line& call, bool copy)
+    {
+        unsigned int function = names.intern(parseFunction(call));
+        if (!keep(function)) {
+            ++stats.filtered;
+            return;
+        }
+        Batch::Entry e = makeEntry(call);
+        e.record.function = function;
+        if (index)
+            index->record(e);
+        if (binary)
+            binary->record(e);
+
+        Thread& t = owner(e.record.threadId);
+        Batch& b = openBatch(t);
+        if (copy) {
+            e.text = b.text.size();
+            b.text.insert(b.text.end(), call.text.data,
+                    call.text.data + call.text.size);
+        }
+        b.entries.push_back(e); // Add work.
+        if (b.full())
+            submit(t, call.offset + 1);
+    }
+
+    /* Same for a ret, it goes to the thread owning its stack. */
+    void process(const Line& line)
+    {
+        Slice name = parseFunction(line);
+        unsigned int function = names.find(name);
+        if (function == NameTable::unknown ? !filter.keep(name)
+                : !keep(function)) {
+            ++stats.filtered;
+            return;
+        }
+        Batch::Entry e = makeEntry(line);
+        e.record.function = function;
+        if (index)
+            index->record(e);
+        add(e);
+    }
+
+    /* An entry that needs no copy, in the batch of its thread. */
+    void add(const Batch::Entry& e)
+    {
+        Thread& t = owner(e.record.threadId);
+        Batch& b = openBatch(t);
+        b.entries.push_back(e);
+        if (b.full())
+            submit(t, e.record.offset + 1);
+    }
+
+    /* The index engine. The calls and rets come from the index instead of
+    the text, with their function ids: all that is left to do is to match
+    them, like the chunked engine would, and to pass the runs through. The
+    lines are still in the mapping for the output. */
+    void replay(const IndexFile& index, OutputSink& os, ReorderWindow& window,
+            Progress& progress)
+    {
+        static const uint64_t blockSize = 1 << 20; // Between flushes.
+        for (size_t i = 0; i < index.header->names; ++i)
+            names.intern(index.name(i)); // The same ids, in the same order.
+
+        const uint64_t records = index.header->records;
+        const uint64_t runs = index.header->runs;
+        uint64_t run = 0;
+        uint64_t flushed = 0;
+        for (uint64_t i = 0;; ++i) {
+            uint64_t offset = i < records ? index.offsets[i] : fileSize;
+            for (; run < runs && index.runs[run].offset < offset; ++run) {
+                if (!summary)
+                    window.passthrough.add(index.runs[run]);
+            }
+            if (offset - flushed >= blockSize || i == records) {
+                flush(os, window, offset);
+                progress.add(offset - flushed, 0);
+                flushed = offset;
+            }
+            if (i == records)
+                break;
+
+            Batch::Entry e = index.entry(i);
+            if (!keep(e)) {
+                ++stats.filtered;
+                continue;
+            }
+            if (binary)
+                binary->record(e);
+            add(e);
+        }
+    }
+
+    /* keep() for an entry of the index. A ret may be of a function no call
+    was ever seen of, it has no id, its name is in its line. */
+    bool keep(const Batch::Entry& e)
+    {
+        if (e.record.function != NameTable::unknown)
+            return keep(e.record.function);
+        if (filter.empty())
+            return true;
+        Line line;
+        line.text = Slice(mapping + e.record.offset, e.size);
+        line.offset = e.record.offset;
+        classifyLine(line);
+        return filter.keep(parseFunction(line));
+    }
+
+    /* Whether the filter keeps the function with this id. Ids are handed
+    out in order, so the verdicts are a plain vector. */
+    bool keep(unsigned int id)
+    {
+        if (filter.empty())
+            return true;
+        while (keeps.size() <= id)
+            keeps.push_back(filter.keep(names.name(keeps.size())));
+        return keeps[id];
+    }
+
+    /* Utility, how many objects are queued for work. As of the last batches
+    we got back. */
+    int size()
+    {
+        int ret = 0;
+        for (const auto& x : pool) {
+            ret += x->pendingSeen;
+        }
+        return ret;
+    }
+
+    Shards shards; // Before the pool, the threads use them to the end.
+    std::vector<std::unique_ptr<ChunkQueue>> queues;
+    Shards::Cache shardCache; // The main thread's.
+
+    /* We use unique_ptr because there where major move semantics issues.
+    Since the only real work in the thread pool is figuring out which thread
+    is available, memory data alignement is not as important. */
+    std::vector<std::unique_ptr<Thread>> pool;
+
+    Doorbell bell; // The threads ring it when a batch is done.
+    const char* mapping; // The input, if it is mapped.
+    std::vector<Parser> unmatched; // Collected from the batches.
+    std::vector<char> unmatchedText; // Their lines, if the input isn't mapped.
+    NameTable names; // Function names of all the calls we have seen.
+    const Filter& filter;
+    IndexWriter* index = nullptr; // Gets the records, if we write one.
+    BinaryWriter* binary = nullptr; // Gets the calls, --binary.
+    std::vector<bool> keeps; // The filter's verdict, by function id.
+    Dialect dialect = AnyDialect; // Sniffed from the first block.
+
+    /* For --summary. */
+    struct WineThread {
+        unsigned int id;
+        uint64_t calls;
+        uint64_t unmatched;
+        size_t maxDepth;
+    };
+    bool summary = false; // Count, don't write anything.
+    std::vector<FunctionCounts> functions; // By function id.
+    std::vector<WineThread> wineThreads; // By id.
+
+    /* For --stats. */
+    Stats stats; // The main thread's.
+    std::vector<Stats> threadStats; // After finish().
+    std::vector<std::pair<unsigned int, size_t>> depths; // Deepest stack per Wine thread.
+
+    /* For the chunked engine. */
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    std::vector<Chunk*> freeChunks; // Not handed out, no batches in flight.
+};
+
+/* With no filter, the index already knows what we would write: the runs
+we pass through and the calls that never got their ret, in input order.
+There is nothing left to match. Returns how many calls that was. */
+uint64_t writeIndexed(const IndexFile& index, OutputSink& os,
+        const char* mapping, Progress& progress)
+{
+    const IndexHeader& h = *index.header;
+    uint64_t run = 0;
+    uint64_t written = 0;
+    auto runsBefore = [&](uint64_t offset) {
+        for (; run < h.runs && index.runs[run].offset < offset; ++run)
+            os.line(Slice(mapping + index.runs[run].offset, index.runs[run].size));
+    };
+    for (uint64_t i = 0; i < h.records; ++i) {
+        if (index.flags[i] & (IndexRet | IndexMatched))
+            continue;
+        runsBefore(index.offsets[i]);
+        os.line(Slice(mapping + index.offsets[i], index.sizes[i]));
+        ++written;
+    }
+    runsBefore(std::numeric_limits<uint64_t>::max());
+    progress.add(fileSize, h.lines);
+    return written;
+}
+
+/* What we were asked to do. */
+struct Options {
+    std::string engine = "auto";
+    bool zstd = false;
+    bool map = true;
+    bool stats = false;
+    bool summary = false;
+    bool profile = false;
+    bool index = false;
+    bool binary = false; // The calls in yourlog_parsed.txt.pwb too.
+    unsigned int top = 20; // Functions in the profile.
+    unsigned int threads = 0; // In the pool, 0 is one per core.
+    uint64_t maxMem = 0; // --max-mem, bytes. 0 is no limit.
+    bool pin = false; // Every thread on a CPU of its own.
+    bool follow = false; // Parse what the log gets, until we are stopped.
+    bool resume = false; // Parse what it got since the last time, once.
+    bool progress = true; // Draw the bar, on a terminal.
+    std::ostream* reports = &std::cout; // --summary and --profile.
+    std::string statsJson; // Where the JSON stats go, if anywhere.
+    Filter filter;
+    std::string filename;
+};
+
+/* The Wine threads with the deepest stacks, deepest first. */
+std::vector<std::pair<unsigned int, size_t>> deepest(const ThreadPool& pool,
+        size_t n)
+{
+    auto depths = pool.depths;
+    std::sort(depths.begin(), depths.end(),
+            [](const std::pair<unsigned int, size_t>& a,
+                    const std::pair<unsigned int, size_t>& b) {
+                return a.second > b.second
+                        || (a.second == b.second && a.first < b.first);
+            });
+    if (depths.size() > n)
+        depths.resize(n);
+    return depths;
+}
+
+/* The --stats report. The times of the threads are added up, so they can be
+more than the wall time. */
+void printStats(std::ostream& os, const ThreadPool& pool, const Stats& total,
+        double wall)
+{
+    auto times = [&](const Stats& s) {
+        os << "read " << s.readTime << " s, classify " << s.classifyTime
+                << " s, match " << s.matchTime << " s, output "
+                << s.outputTime << " s, waiting " << s.waitTime << " s";
+    };
+
+    os << std::fixed << std::setprecision(3)
+            << "Stats, " << wall << " s:" << std::endl
+            << "  read        " << total.bytes << " bytes, " << total.lines
+            << " lines" << std::endl
+            << "  calls       " << total.calls << std::endl
+            << "  rets        " << total.rets << ": " << total.fastMatches
+            << " on top, " << total.fallbackMatches << " deeper, "
+            << total.lostRets << " matched nothing" << std::endl
+            << "  unmatched   " << total.unmatchedCalls << " calls" << std::endl
+            << "  pending     " << total.maxPending << " calls at most"
+            << std::endl
+            << "  batches     " << total.batches << std::endl
+            << "  filtered    " << total.filtered << " calls and rets"
+            << std::endl
+            << "  stolen      " << total.stolen << " chunks" << std::endl
+            << "  spilled     " << total.spilled << " calls" << std::endl
+            << "  dialect     " << dialectNames[pool.dialect] << std::endl;
+
+    os << "  deepest     ";
+    for (const auto& x : deepest(pool, 5))
+        os << std::hex << std::setw(4) << std::setfill('0') << x.first
+                << std::dec << std::setfill(' ') << ":" << x.second << " ";
+    os << std::endl << "  time        ";
+    times(total);
+    os << std::endl << "  main        ";
+    times(pool.stats);
+    for (size_t i = 0; i < pool.threadStats.size(); ++i) {
+        os << std::endl << "  thread " << std::left << std::setw(5) << i
+                << std::right;
+        times(pool.threadStats[i]);
+    }
+    os << std::endl;
+    os.unsetf(std::ios::floatfield);
+}
+
+/* The --summary report, the busiest functions first. It is what we were
+asked for, so it goes to stdout. */
+void printSummary(std::ostream& os, const ThreadPool& pool)
+{
+    std::vector<unsigned int> order;
+    FunctionCounts total;
+    for (unsigned int i = 0; i < pool.functions.size(); ++i) {
+        if (!pool.functions[i].calls)
+            continue;
+        order.push_back(i);
+        total.add(pool.functions[i]);
+    }
+    std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+        const FunctionCounts& x = pool.functions[a];
+        const FunctionCounts& y = pool.functions[b];
+        if (x.calls != y.calls)
+            return x.calls > y.calls;
+        if (x.unmatched != y.unmatched)
+            return x.unmatched > y.unmatched;
+        return a < b;
+    });
+
+    os << order.size() << " functions, " << total.calls << " calls, "
+            << total.unmatched << " unmatched, " << total.maxDepth
+            << " deep at most" << std::endl << std::endl;
+    os << std::setw(12) << "calls" << std::setw(11) << "unmatched"
+            << std::setw(7) << "depth" << "  function" << std::endl;
+    for (auto i : order) {
+        const FunctionCounts& f = pool.functions[i];
+        os << std::setw(12) << f.calls << std::setw(11) << f.unmatched
+                << std::setw(7) << f.maxDepth << "  " << pool.names.name(i)
+                << "\n";
+    }
+
+    os << std::endl << std::setw(12) << "calls" << std::setw(11) << "unmatched"
+            << std::setw(7) << "depth" << "  thread" << std::endl;
+    for (const auto& w : pool.wineThreads) {
+        os << std::setw(12) << w.calls << std::setw(11) << w.unmatched
+                << std::setw(7) << w.maxDepth << "  " << std::hex
+                << std::setw(4) << std::setfill('0') << w.id << std::dec
+                << std::setfill(' ') << "\n";
+    }
+    os.flush();
+}
+
+/* The --profile report: the functions that took the most time, with and
+without the calls they made, like a profiler would. */
+void printProfile(std::ostream& os, const ThreadPool& pool, unsigned int top)
+{
+    std::vector<unsigned int> order;
+    uint64_t timed = 0;
+    for (unsigned int i = 0; i < pool.functions.size(); ++i) {
+        if (!pool.functions[i].timed)
+            continue;
+        order.push_back(i);
+        timed += pool.functions[i].timed;
+    }
+    if (!timed) {
+        os << "No timestamps to profile with, run wine with "
+                "WINEDEBUG=+timestamp,+relay." << std::endl;
+        return;
+    }
+
+    auto table = [&](const char* what, uint64_t FunctionCounts::*by) {
+        std::sort(order.begin(), order.end(),
+                [&](unsigned int a, unsigned int b) {
+                    uint64_t x = pool.functions[a].*by;
+                    uint64_t y = pool.functions[b].*by;
+                    return x != y ? x > y : a < b;
+                });
+        os << std::endl << "Top " << std::min<size_t>(top, order.size())
+                << " by " << what << " time, in ms:" << std::endl
+                << std::setw(12) << "calls" << std::setw(13) << "inclusive"
+                << std::setw(13) << "exclusive" << std::setw(11) << "average"
+                << std::setw(10) << "longest" << "  function" << std::endl;
+        for (size_t i = 0; i < order.size() && i < top; ++i) {
+            const FunctionCounts& f = pool.functions[order[i]];
+            os << std::setw(12) << f.timed << std::setw(13) << f.inclusive
+                    << std::setw(13) << f.exclusive << std::setw(11)
+                    << std::fixed << std::setprecision(3)
+                    << double(f.inclusive) / f.timed << std::setw(10)
+                    << f.longest << "  " << pool.names.name(order[i]) << "\n";
+        }
+        os.unsetf(std::ios::floatfield);
+    };
+
+    os << timed << " calls timed, " << order.size() << " functions"
+            << std::endl;
+    table("inclusive", &FunctionCounts::inclusive);
+    table("exclusive", &FunctionCounts::exclusive);
+    os.flush();
+}
+
+/* The same as JSON, for the scripts. */
+bool writeStatsJson(const std::string& f, const ThreadPool& pool,
+        const Stats& total, double wall)
+{
+    std::FILE* out = std::fopen(f.c_str(), "w");
+    if (!out)
+        return false;
+
+    auto stats = [&](const Stats& s) {
+        std::fprintf(out, "{\"bytes\": %llu, \"lines\": %llu, \"calls\": %llu, "
+                "\"rets\": %llu, \"fastMatches\": %llu, "
+                "\"fallbackMatches\": %llu, \"lostRets\": %llu, "
+                "\"unmatchedCalls\": %llu, \"maxPending\": %llu, "
+                "\"batches\": %llu, \"filtered\": %llu, \"stolen\": %llu, "
+                "\"spilled\": %llu, "
+                "\"readTime\": %.6f, "
+                "\"classifyTime\": %.6f, \"matchTime\": %.6f, "
+                "\"outputTime\": %.6f, \"waitTime\": %.6f}",
+                (unsigned long long)s.bytes, (unsigned long long)s.lines,
+                (unsigned long long)s.calls, (unsigned long long)s.rets,
+                (unsigned long long)s.fastMatches,
+                (unsigned long long)s.fallbackMatches,
+                (unsigned long long)s.lostRets,
+                (unsigned long long)s.unmatchedCalls,
+                (unsigned long long)s.maxPending,
+                (unsigned long long)s.batches,
+                (unsigned long long)s.filtered,
+                (unsigned long long)s.stolen,
+                (unsigned long long)s.spilled, s.readTime, s.classifyTime,
+                s.matchTime, s.outputTime, s.waitTime);
+    };
+
+    std::fprintf(out, "{\"wall\": %.6f,\n\"total\": ", wall);
+    stats(total);
+    std::fprintf(out, ",\n\"main\": ");
+    stats(pool.stats);
+    std::fprintf(out, ",\n\"threads\": [");
+    for (size_t i = 0; i < pool.threadStats.size(); ++i) {
+        std::fprintf(out, i ? ",\n  " : "\n  ");
+        stats(pool.threadStats[i]);
+    }
+    std::fprintf(out, "],\n\"maxDepth\": {");
+    auto depths = deepest(pool, pool.depths.size());
+    for (size_t i = 0; i < depths.size(); ++i)
+        std::fprintf(out, "%s\"%04x\": %llu", i ? ", " : "", depths[i].first,
+                (unsigned long long)depths[i].second);
+    std::fprintf(out, "}}\n");
+    return !std::fclose(out);
+}
+
+/* How long the stages of a run took, in seconds. For the benchmark. */
+struct Timings {
+    double parse = 0; // Reading, matching and writing what is final.
+    double output = 0; // Writing what was left at the end.
+};
+
+/* --follow and --resume, where the last refresh of a log left off. It goes
+in a small file next to the log, yourlog.txt.pws, so the next run picks up
+from there too. The log is mapped and only grows, so everything we held back
+is still in it: we keep the offsets of the lines only. The calls waiting for
+their ret are parsed again when we resume, their names interned again. */
+struct FollowHeader {
+    static const uint32_t currentVersion = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t dialect;
+    uint64_t device; // The log, a new file in its place starts over.
+    uint64_t inode;
+    uint64_t head; // Hash of its first bytes, in case it was written over.
+    uint64_t settings; // Hash of the filters.
+    uint64_t offset; // Parsed up to here, a line boundary.
+    uint64_t output; // Bytes of the output that are final.
+    int64_t outputTime; // Its mtime when we were done with it, in ns.
+    uint64_t calls; // Waiting for their ret.
+    uint64_t unmatched; // Known unmatched, waiting to be written.
+    uint64_t runs; // Lines waiting to be written.
+};
+
+struct FollowState {
+    static const size_t headSize = 4096;
+
+    /* The start of the log, what tells us it was written over. */
+    static uint64_t headHash(const char* data, uint64_t size)
+    {
+        return SliceHash()(Slice(data, std::min<uint64_t>(size, headSize)));
+    }
+
+    /* What the filters are, they have to be the same to go on. */
+    static uint64_t settingsHash(const Filter& filter)
+    {
+        std::string s;
+        for (const auto& p : filter.includes)
+            s += "+" + p.dll + "." + p.function;
+        for (const auto& p : filter.excludes)
+            s += "-" + p.dll + "." + p.function;
+        return SliceHash()(Slice(s.data(), s.size()));
+    }
+
+    /* Read path. False if there is none, or it is no good anymore: why
+    tells what changed. */
+    bool load(const std::string& path, std::string& why)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0
+                && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+                && !std::memcmp(header.magic, "PWLSTATE", 8)
+                && header.version == FollowHeader::currentVersion
+                && header.dialect < dialectCount;
+        uint64_t expected = sizeof(header) + 8 * (header.calls + header.unmatched)
+                + sizeof(Passthrough::Run) * header.runs;
+        ok = ok && static_cast<uint64_t>(st.st_size) == expected;
+        if (ok) {
+            calls.resize(header.calls);
+            unmatched.resize(header.unmatched);
+            runs.resize(header.runs);
+            uint64_t at = sizeof(header);
+            ok = get(fd, at, calls.data(), 8 * calls.size())
+                    && get(fd, at, unmatched.data(), 8 * unmatched.size())
+                    && get(fd, at, runs.data(),
+                            sizeof(Passthrough::Run) * runs.size());
+        }
+        close(fd);
+        if (!ok)
+            why = "The state file is broken";
+        return ok;
+    }
+
+    static bool get(int fd, uint64_t& at, void* data, size_t size)
+    {
+        bool ok = pread(fd, data, size, at) == static_cast<ssize_t>(size);
+        at += size;
+        return ok;
+    }
+
+    /* Written next to it and renamed, like the index. */
+    bool save(const std::string& path)
+    {
+        std::memcpy(header.magic, "PWLSTATE", 8);
+        header.version = FollowHeader::currentVersion;
+        header.calls = calls.size();
+        header.unmatched = unmatched.size();
+        header.runs = runs.size();
+
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+        bool ok = writeAll(fd, reinterpret_cast<const char*>(&header), sizeof(header))
+                && writeAll(fd, reinterpret_cast<const char*>(calls.data()),
+                        8 * calls.size())
+                && writeAll(fd, reinterpret_cast<const char*>(unmatched.data()),
+                        8 * unmatched.size())
+                && writeAll(fd, reinterpret_cast<const char*>(runs.data()),
+                        sizeof(Passthrough::Run) * runs.size());
+        ok = ::close(fd) == 0 && ok;
+        if (ok && rename(tmp.c_str(), path.c_str()) == 0)
+            return true;
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    /* Start over, on the log we have now. */
+    void reset(const struct stat& st)
+    {
+        std::memset(&header, 0, sizeof(header));
+        header.device = st.st_dev;
+        header.inode = st.st_ino;
+        calls.clear();
+        unmatched.clear();
+        runs.clear();
+    }
+
+    /* The line at offset of the mapping, classified again. */
+    static Line lineAt(const char* mapping, uint64_t offset)
+    {
+        const char* p = mapping + offset;
+        const char* end = static_cast<const char*>(
+                std::memchr(p, '\n', fileSize - offset));
+        Line line;
+        line.text = Slice(p, end ? end - p : fileSize - offset);
+        line.offset = offset;
+        classifyLine(line);
+        return line;
+    }
+
+    /* What the window held goes back in. */
+    void restore(ReorderWindow& window, const char* mapping) const
+    {
+        for (const auto& r : runs)
+            window.passthrough.add(r);
+        for (uint64_t offset : unmatched) {
+            Line line = lineAt(mapping, offset);
+            window.unmatched(Parser(parseRecord(line), line.text.size, offset),
+                    nullptr);
+        }
+    }
+
+    /* And the calls on their stacks. They are in input order, so every
+    stack gets them bottom up. */
+    void restore(ThreadPool& pool, const char* mapping) const
+    {
+        for (uint64_t offset : calls)
+            pool.enqueue(lineAt(mapping, offset), false);
+    }
+
+    /* Once the pool is done: what is left in the stacks and the window. */
+    void keep(ThreadPool& pool, ReorderWindow& window)
+    {
+        calls.clear();
+        for (const auto& t : pool.pool) {
+            for (auto& x : t->callStacks) {
+                for (const auto& call : x.second.calls)
+                    calls.push_back(call.Record.offset);
+                pool.forEachSpilled(x.second, [&](Parser& call, const char*) {
+                    calls.push_back(call.Record.offset);
+                });
+            }
+        }
+        std::sort(calls.begin(), calls.end());
+        runs.clear();
+        unmatched.clear();
+        window.take(runs, unmatched);
+    }
+
+    FollowHeader header;
+    std::vector<uint64_t> calls;
+    std::vector<uint64_t> unmatched;
+    std::vector<Passthrough::Run> runs;
+
+    /* For the refresh, not saved. */
+    std::unique_ptr<InputReader> input; // The log, the whole lines of it.
+    bool tail = false; // Write what we hold back too, we stop after this.
+};
+
+/* Our main software, we will:
+Open the input file, create the output file.
+Read the input file, create functor parser objects.
+Notify the threadpool that when a new line is ready for parsing.
+Print a progress bar.
+Finally output the remaining parser objects in the output file.
+Close the open files.
+...
+profit */
+int parseLog(Options options, Timings* timings = nullptr,
+        FollowState* follow = nullptr)
+{
+    auto started = std::chrono::steady_clock::now();
+    const std::string& filename = options.filename;
+    std::string& engine = options.engine;
+    bool zstd = options.zstd;
+
+    /* Initialize. With - the output is stdout, so we keep quiet there.
+    Same for the summary. */
+    bool report = options.summary || options.profile;
+    if (filename == "-" || report)
+        status = &std::cerr;
+    std::unique_ptr<InputReader> inFile = follow ? std::move(follow->input)
+            : openInFile(filename, options.map); // Open input log.
+    if (!inFile)
+        return 1;
+
+    /* The chunked engine keeps slices of the blocks in its batches, it
+    needs them to stay put. */
+    if (engine == "auto")
+        engine = inFile->stable() ? "chunked" : "pipeline";
+    if (engine == "chunked" && !inFile->stable()) {
+        *status << "The chunked engine needs an uncompressed regular file." << std::endl;
+        return 1;
+    }
+    std::unique_ptr<OutputSink> outFile;
+    if (report) {
+        outFile.reset(new OutputSink(-1)); // Nothing goes there.
+    } else if (filename != "-") {
+        outFile = openOutFile(filename, zstd, follow ? follow->header.output : 0); // Open output file for writing.
+        if (!outFile)
+            return 1;
+    } else {
+        int fd = dup(STDOUT_FILENO);
+        outFile.reset(zstd ? new ZstdSink(fd) : new OutputSink(fd));
+    }
+    if (inFile->mapping())
+        outFile->setMapping(inFile->mapping(), fileSize);
+    OutputSink& out = *outFile;
+
+    /* --binary goes next to the text output, the matched calls too. */
+    std::string binaryPath = outputName(filename, false) + ".pwb";
+    std::unique_ptr<BinaryWriter> binaryWriter;
+    if (options.binary && (report || follow || filename == "-"))
+        *status << "--binary goes next to the output file of a log file, "
+                "no binary output." << std::endl;
+    else if (options.binary)
+        binaryWriter.reset(new BinaryWriter());
+
+    /* --index: the index of the log if there is a good one, or we write it
+    on the way. It has to be the whole story, so only a run without filters
+    or reports writes one. */
+    std::string indexPath = filename + ".pwi";
+    int64_t logTime = modifiedTime(filename);
+    std::unique_ptr<IndexFile> index;
+    std::unique_ptr<IndexWriter> indexWriter;
+    if (options.index && !inFile->mapping()) {
+        *status << "The index needs a regular file we can map." << std::endl;
+    } else if (options.index) {
+        index.reset(new IndexFile());
+        if (index->open(indexPath, fileSize, logTime)) {
+            engine = "index";
+            *status << "Reading the index: " << indexPath << std::endl;
+        } else {
+            index.reset();
+            if (options.filter.empty() && !report)
+                indexWriter.reset(new IndexWriter());
+            else
+                *status << "No index yet, a run without filters and "
+                        "reports writes it." << std::endl;
+        }
+    }
+
+    /* Create the ThreadPool object. This contains our threads (on my
+    laptop 7 threads), and takes care of distributing the work load. */
+    ThreadPool workerPool(inFile->mapping(), options.filter, options.threads,
+            options.pin);
+    workerPool.summary = report;
+    workerPool.index = indexWriter.get();
+    workerPool.binary = binaryWriter.get();
+
+    /* The lines are only slices of the input, nothing is allocated. Calls
+    have to be copied if the reader can't keep them around though. */
+    Slice block;
+    std::vector<Line> lines;
+    bool copyCalls = !inFile->stable();
+
+    /* The lines we pass through wait here, until we know no unmatched call
+    has to go in front of them. */
+    ReorderWindow window(inFile->mapping());
+    window.keepWritten = indexWriter || binaryWriter;
+
+    /* --max-mem: what piles up with the pending calls. Half of it for the
+    stacks, the other half for the calls and lines waiting to be written.
+    The rest we hold doesn't grow with the log. */
+    if (options.maxMem) {
+        workerPool.limitMemory(options.maxMem / 2);
+        window.callLimit = options.maxMem / 4;
+        window.passthrough.memoryLimit = options.maxMem / 4;
+    }
+
+    /* --follow, what the last refresh held back. The batches go before any
+    of the new lines. */
+    if (follow && follow->header.offset) {
+        workerPool.dialect = static_cast<Dialect>(follow->header.dialect);
+        follow->restore(window, inFile->mapping());
+        follow->restore(workerPool, inFile->mapping());
+        workerPool.flush(out, window, inFile->offset());
+    }
+
+    /* Only for a terminal, a log file full of bars helps nobody. */
+    Progress progress(fileSize - inFile->offset(),
+            options.progress
+                    && isatty(status == &std::cerr ? STDERR_FILENO : STDOUT_FILENO));
+
+    /* The threads do it all. */
+    Stats& stats = workerPool.stats;
+    if (engine == "chunked")
+        workerPool.parseChunks(*inFile, out, window, progress);
+
+    /* Or the index has it all already. */
+    if (engine == "index" && (!options.filter.empty() || report || binaryWriter))
+        workerPool.replay(*index, out, window, progress);
+    else if (engine == "index")
+        window.callsWritten = writeIndexed(*index, out, inFile->mapping(),
+                progress);
+    if (engine == "index") {
+        stats.bytes = fileSize;
+        stats.lines = index->header->lines;
+    }
+
+    /* Or read input file a block at a time, queue the calls, process the
+    rets or add to finale output. */
+    while (engine == "pipeline") {
+        uint64_t offset = inFile->offset(); // Where the block starts.
+        {
+            StageTimer timer(stats.readTime);
+            if (!inFile->getBlock(block))
+                break;
+        }
+
+        /* Waiting for a batch to come back doesn't count as work. */
+        double waited = stats.waitTime;
+        auto classified = std::chrono::steady_clock::now();
+        if (!offset)
+            workerPool.dialect = sniffDialect(block);
+        scanLines(block, offset, lines, workerPool.dialect);
+        stats.bytes += block.size;
+        stats.lines += lines.size();
+        if (indexWriter) {
+            indexWriter->mark(offset);
+            indexWriter->lines += lines.size();
+        }
+
+        for (const auto& line : lines) {
+            /* The line is a Call. This is a future work object. Add it to
+            the thread pool to be eventually processed. */
+            if (line.kind == CallLine) {
+                workerPool.enqueue(line, copyCalls);
+
+            /* The line is a ret. Process the stored calls to match the
+            return line. */
+            } else if (line.kind == RetLine) {
+                workerPool.process(line);
+
+            /* This is not a line we can parse. Add it to the output log,
+            "in sequence" with the unmatched calls. */
+            } else if (!report) {
+                window.passthrough.add(line);
+                if (indexWriter)
+                    indexWriter->run(Passthrough::Run{line.offset, line.text.size});
+            }
+        }
+        if (timeStages)
+            stats.classifyTime += secondsSince(classified)
+                    - (stats.waitTime - waited);
+
+        /* Hand the batches over, write what is final. */
+        workerPool.flush(out, window, inFile->offset());
+
+        progress.add(block.size, lines.size());
+    }
+
+    /* Finalize */
+    workerPool.finish();
+    progress.stop();
+    *status << "Lines left: " << workerPool.size()
+        << (report ? "" : follow && !follow->tail ? " -- Kept for the next refresh."
+                : " -- Outputting to file.")
+        << std::endl; // Alert user.
+    auto parsed = std::chrono::steady_clock::now();
+
+    /* --follow: what is final is written, where that ends is where the
+    next refresh writes. What we hold back is kept for it, and only written
+    if we stop. */
+    if (follow) {
+        workerPool.flush(out, window, inFile->offset());
+        off_t at = out.flush() ? lseek(out.fd, 0, SEEK_CUR) : -1;
+        if (at < 0)
+            return 1;
+        follow->header.output = at;
+        follow->header.offset = inFile->offset();
+        follow->header.dialect = workerPool.dialect;
+        follow->keep(workerPool, window);
+        if (follow->tail)
+            follow->restore(window, inFile->mapping());
+    }
+
+    /* Write all the remaining work to the output file. These are the
+    "calls" that weren't matched with "ret"urns, in between the lines we
+    passed through. */
+    if (report) {
+        workerPool.summarize();
+        if (options.summary)
+            printSummary(*options.reports, workerPool);
+        if (options.profile)
+            printProfile(*options.reports, workerPool, options.top);
+    } else if (!follow || follow->tail) {
+        workerPool.write(out, window);
+    }
+
+    /* Cleanup. The output may still point into the mapping, it goes
+    first. */
+    bool written;
+    {
+        StageTimer timer(workerPool.stats.outputTime);
+        written = out.finish();
+    }
+    bool complete = !inFile->failed(); // Or the output is cut short.
+    outFile.reset();
+    inFile.reset();
+
+    if (indexWriter && written && complete) {
+        if (indexWriter->write(indexPath, workerPool.names, window.written,
+                    fileSize, logTime))
+            *status << "Index written: " << indexPath << std::endl;
+        else
+            *status << "Couldn't write the index: " << indexPath << std::endl;
+    }
+    if (binaryWriter && written && complete) {
+        if (binaryWriter->write(binaryPath, workerPool.names, window.written,
+                    fileSize))
+            *status << "Binary output written: " << binaryPath << std::endl;
+        else
+            *status << "Couldn't write the binary output: " << binaryPath
+                    << std::endl;
+    }
+
+    if (options.stats || !options.statsJson.empty()) {
+        Stats total = workerPool.stats;
+        for (const auto& x : workerPool.threadStats)
+            total.add(x);
+        total.unmatchedCalls = window.callsWritten;
+        total.spilled += window.spilledCalls;
+        for (const auto& x : workerPool.wineThreads)
+            total.unmatchedCalls += x.unmatched;
+        double wall = secondsSince(started);
+        if (options.stats)
+            printStats(*status, workerPool, total, wall);
+        if (!options.statsJson.empty()
+                && !writeStatsJson(options.statsJson, workerPool, total, wall)) {
+            *status << "Couldn't write the stats: " << options.statsJson
+                    << std::endl;
+            written = false;
+        }
+    }
+
+    if (timings) {
+        timings->parse = std::chrono::duration<double>(parsed - started).count();
+        timings->output = secondsSince(parsed);
+    }
+    return written && complete ? 0 : 1;
+}
+
+/* Set by SIGINT and SIGTERM while we follow a log. We write what we held
+back, and stop. */
+volatile sig_atomic_t stopFollowing = 0;
+
+static void onStop(int)
+{
+    stopFollowing = 1;
+}
+
+/* The end of the last whole line of fd between from and size, or from if
+there is none. The writer may be in the middle of a line, it is for the
+next refresh. */
+uint64_t lastLineEnd(int fd, uint64_t from, uint64_t size)
+{
+    std::vector<char> buffer(64 << 10);
+    while (size > from) {
+        size_t n = std::min<uint64_t>(buffer.size(), size - from);
+        if (pread(fd, buffer.data(), n, size - n) != static_cast<ssize_t>(n))
+            return from;
+        for (size_t i = n; i-- > 0;) {
+            if (buffer[i] == '\n')
+                return size - n + i + 1;
+        }
+        size -= n;
+    }
+    return from;
+}
+
+/* Why the state can't go on with the log in st and fd, or nullptr if it
+can. */
+const char* staleState(const FollowState& state, int fd, const struct stat& st,
+        uint64_t settings, const std::string& outPath)
+{
+    const FollowHeader& h = state.header;
+    if (h.device != static_cast<uint64_t>(st.st_dev)
+            || h.inode != static_cast<uint64_t>(st.st_ino))
+        return "The log was replaced";
+    if (static_cast<uint64_t>(st.st_size) < h.offset)
+        return "The log got shorter";
+    std::vector<char> head(std::min<uint64_t>(h.offset, FollowState::headSize));
+    if (pread(fd, head.data(), head.size(), 0) != static_cast<ssize_t>(head.size())
+            || FollowState::headHash(head.data(), head.size()) != h.head)
+        return "The log was written over";
+    if (h.settings != settings)
+        return "The filters changed";
+    struct stat out;
+    if (h.offset && (stat(outPath.c_str(), &out) != 0
+            || static_cast<uint64_t>(out.st_size) < h.output
+            || modifiedTime(outPath) != h.outputTime))
+        return "The output was changed";
+    return nullptr;
+}
+
+/* --follow and --resume. Parse what was added to the log since the state
+file says we were last here, then wait for more with inotify, or stop. A
+refresh costs what is new and what we still hold back, nothing else. The
+output gets what is final. The lines behind a call that still waits for its
+ret are written when we stop, what a full run would write, and taken back
+by the next refresh. */
+int followLog(Options options, bool keepGoing)
+{
+    const std::string& filename = options.filename;
+    if (filename == "-" || options.summary || options.profile || options.index
+            || options.zstd) {
+        *status << "--follow and --resume write a plain output file, for a log "
+                "file." << std::endl;
+        return 1;
+    }
+    std::string statePath = filename + ".pws";
+    std::string outPath = outputName(filename, false);
+    uint64_t settings = FollowState::settingsHash(options.filter);
+    bool progress = options.progress;
+
+    FollowState state;
+    std::string why;
+    bool loaded = state.load(statePath, why);
+    if (!why.empty())
+        *status << why << ", starting over." << std::endl;
+
+    /* We get woken up when the log changes. If we can't watch it, we look
+    every second. */
+    int notify = -1;
+    int watch = -1;
+    if (keepGoing) {
+        notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = onStop; // No SA_RESTART, poll() has to return.
+        sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+    }
+
+    auto refreshed = std::chrono::steady_clock::now() - std::chrono::hours(1);
+    while (true) {
+        bool last = !keepGoing || stopFollowing;
+        if (notify >= 0 && watch < 0)
+            watch = inotify_add_watch(notify, filename.c_str(), IN_MODIFY
+                    | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+
+        /* A log being rotated may not be there for a moment. */
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            if (fd >= 0)
+                close(fd);
+            if (!keepGoing) {
+                *status << "Couldn't read input file: " << filename << std::endl;
+                return 1;
+            }
+            fd = -1;
+        }
+
+        char magic[maxMagic];
+        if (fd >= 0 && sniffFormat(Slice(magic,
+                    std::max<ssize_t>(pread(fd, magic, maxMagic, 0), 0)))) {
+            close(fd);
+            *status << "Can't follow a compressed log: " << filename << std::endl;
+            return 1;
+        }
+
+        if (fd >= 0) {
+            const char* stale = loaded
+                    ? staleState(state, fd, st, settings, outPath) : nullptr;
+            if (stale)
+                *status << stale << ", starting over." << std::endl;
+            if (!loaded || stale) {
+                state.reset(st);
+                state.header.settings = settings;
+                loaded = true;
+            }
+            const FollowHeader& h = state.header;
+            uint64_t end = lastLineEnd(fd, h.offset, st.st_size);
+
+            /* Anything we held back goes out when we stop, unless it
+            already did. */
+            struct stat out;
+            bool held = !state.calls.empty() || !state.unmatched.empty()
+                    || !state.runs.empty();
+            bool written = stat(outPath.c_str(), &out) == 0
+                    && static_cast<uint64_t>(out.st_size) > h.output;
+            bool refresh = end > h.offset || (last && held && !written);
+
+            void* data = refresh ? mmap(nullptr, end, PROT_READ, MAP_PRIVATE,
+                    fd, 0) : MAP_FAILED;
+            close(fd);
+            if (refresh && data == MAP_FAILED) {
+                *status << "Couldn't map input file: " << filename << std::endl;
+                return 1;
+            }
+            if (refresh) {
+                madvise(data, end, MADV_SEQUENTIAL);
+                MappedReader* reader = new MappedReader(
+                        static_cast<const char*>(data), end);
+                reader->seek(h.offset);
+                state.input.reset(reader);
+                state.tail = last;
+                state.header.head = FollowState::headHash(
+                        static_cast<const char*>(data), end);
+                fileSize = end;
+                *status << "Parsing: " << filename << " -- From: "
+                        << h.offset / 1000000 << " MB, new: "
+                        << (end - h.offset) / 1000 << " KB, held back: "
+                        << state.calls.size() << " calls" << std::endl;
+
+                options.progress = progress && !h.offset;
+                refreshed = std::chrono::steady_clock::now();
+                int ret = parseLog(options, nullptr, &state);
+                if (ret)
+                    return ret;
+                state.header.outputTime = modifiedTime(outPath);
+                if (!state.save(statePath)) {
+                    *status << "Couldn't write the state: " << statePath
+                            << std::endl;
+                    return 1;
+                }
+            } else if (!keepGoing) {
+                *status << "Nothing new in: " << filename << std::endl;
+            }
+        }
+        if (last)
+            break;
+
+        /* Wait for the log to change, or to be told to stop. Not more than
+        a few refreshes a second though, the writer keeps us busy enough. */
+        struct pollfd p = {notify, POLLIN, 0};
+        poll(&p, notify >= 0 ? 1 : 0, watch >= 0 ? -1 : 1000);
+        alignas(inotify_event) char events[4096];
+        ssize_t n;
+        while (notify >= 0 && (n = read(notify, events, sizeof(events))) > 0) {
+            for (ssize_t i = 0; i < n;) {
+                auto e = reinterpret_cast<const inotify_event*>(events + i);
+                if (e->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) {
+                    inotify_rm_watch(notify, watch); // Watch the new one.
+                    watch = -1;
+                }
+                i += sizeof(inotify_event) + e->len;
+            }
+        }
+        if (!stopFollowing)
+            std::this_thread::sleep_until(refreshed + std::chrono::milliseconds(250));
+    }
+    if (notify >= 0)
+        close(notify);
+    return 0;
+}
+
+/* What the log generator makes. */
+struct GenOptions {
+    uint64_t size = 256 << 20; // Bytes, about.
+    unsigned int threads = 8; // Wine threads.
+    unsigned int depth = 16; // Deepest nesting.
+    double unmatched = 0.01; // Calls whose ret is lost.
+    double noise = 0.1; // Lines that aren't calls or rets.
+    uint64_t seed = 1;
+};
+
+/* xorshift64*, fast and good enough for fake logs. */
+struct Random {
+    Random(uint64_t seed) : state(seed * 2685821657736338717ull | 1) {}
+
+    uint64_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ull;
+    }
+
+    uint64_t below(uint64_t n) { return next() % n; }
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    uint64_t state;
+};
+
+/* Write a synthetic +relay log. The threads come in bursts like in a real
+trace, a few functions are called a lot more than the rest, and the lines
+in between look like the trace:, fixme: and err: lines Wine leaves there.
+Returns how many lines were written. */
+uint64_t generateLog(const GenOptions& o, std::FILE* out)
+{
+    static const char* dlls[] = {"ntdll", "KERNEL32", "KERNELBASE", "user32",
+        "gdi32", "advapi32", "msvcrt", "ole32", "ws2_32", "winmm"};
+    static const char* noise[] = { // All take a number and a pointer.
+        "trace:heap:RtlAllocateHeap (%08x,00000002): returning %p\n",
+        "fixme:ntdll:NtQuerySystemInformation info_class %08x, buffer %p\n",
+        "err:ole:CoGetClassObject class {%08x-0000-0000-c000-000000000046} not registered, %p\n",
+        "warn:file:CreateFileW Unable to create file L\"C:\\tmp\\%08x\" (handle %p)\n",
+    };
+
+    std::vector<std::string> functions;
+    for (unsigned int i = 0; i < 2000; ++i)
+        functions.push_back(std::string(dlls[i % 10]) + ".Function"
+                + std::to_string(i));
+
+    struct Frame {
+        unsigned int function;
+        uint32_t retAddr;
+    };
+    std::vector<std::vector<Frame>> stacks(std::max(1u, o.threads));
+    Random random(o.seed);
+    std::vector<char> line(512);
+    uint64_t written = 0;
+    uint64_t lines = 0;
+    unsigned int thread = 0;
+
+    auto emit = [&](int n) {
+        std::fwrite(&line[0], 1, n, out);
+        written += n;
+        ++lines;
+    };
+
+    while (written < o.size) {
+        if (random.uniform() < 0.1)
+            thread = random.below(stacks.size()); // End of the burst.
+        unsigned int tid = 0x20 + thread;
+        std::vector<Frame>& stack = stacks[thread];
+
+        if (random.uniform() < o.noise) {
+            void* p = reinterpret_cast<void*>(random.next() & 0xffffff0);
+            int n = std::snprintf(&line[0], line.size(), "%04x:", tid);
+            emit(n + std::snprintf(&line[n], line.size() - n,
+                    noise[random.below(4)],
+                    static_cast<unsigned int>(random.below(1 << 16)), p));
+            continue;
+        }
+
+        /* Return, if we are deep enough or feel like it. */
+        if (!stack.empty() && (stack.size() >= o.depth || random.uniform() < 0.5)) {
+            Frame f = stack.back();
+            stack.pop_back();
+            if (random.uniform() < o.unmatched)
+                continue; // Lost, the call stays unmatched.
+            emit(std::snprintf(&line[0], line.size(),
+                    "%04x:Ret  %s() retval=%08x ret=%08x\n", tid,
+                    functions[f.function].c_str(),
+                    static_cast<unsigned int>(random.below(1 << 16)), f.retAddr));
+            continue;
+        }
+
+        /* A call. Small ids are the popular ones. */
+        Frame f;
+        f.function = random.below(random.below(functions.size()) + 1);
+        f.retAddr = 0x7b000000 + static_cast<uint32_t>(random.below(1 << 20));
+        stack.push_back(f);
+        emit(std::snprintf(&line[0], line.size(),
+                "%04x:Call %s(%08x,%08x) ret=%08x\n", tid,
+                functions[f.function].c_str(),
+                static_cast<unsigned int>(random.next()),
+                static_cast<unsigned int>(random.next()), f.retAddr));
+    }
+    return lines;
+}
+
+/* The generator options, both gen and bench take them. Advances i past the
+option and its value. */
+bool parseGenOption(int argc, char** argv, int& i, GenOptions& o)
+{
+    std::string arg = argv[i];
+    if (i + 1 >= argc)
+        return false;
+    const char* value = argv[i + 1];
+    if (arg == "--size")
+        o.size = std::strtoull(value, nullptr, 10) << 20;
+    else if (arg == "--threads")
+        o.threads = std::strtoul(value, nullptr, 10);
+    else if (arg == "--depth")
+        o.depth = std::max(1ul, std::strtoul(value, nullptr, 10));
+    else if (arg == "--unmatched")
+        o.unmatched = std::strtod(value, nullptr);
+    else if (arg == "--noise")
+        o.noise = std::strtod(value, nullptr);
+    else if (arg == "--seed")
+        o.seed = std::strtoull(value, nullptr, 10);
+    else
+        return false;
+    ++i;
+    return true;
+}
+
+std::string genHelp = "Usage: parsewinelog gen [options] out.log | -\n"
+        "       parsewinelog bench [options] [--runs N] [--keep]\n"
+        "  --size MB         how big the log gets (256)\n"
+        "  --threads N       Wine threads (8)\n"
+        "  --depth N         deepest nesting (16)\n"
+        "  --unmatched R     share of calls whose ret is lost (0.01)\n"
+        "  --noise R         share of lines that aren't relay lines (0.1)\n"
+        "  --seed N          same seed, same log (1)\n"
+        "bench makes a log, parses it with every engine and reports the best\n"
+        "of the runs. --keep leaves the log in the temporary directory.";
+
+/* gen: write a synthetic log. */
+int gen(int argc, char** argv)
+{
+    GenOptions o;
+    std::string filename;
+    for (int i = 1; i < argc; ++i) {
+        if (parseGenOption(argc, argv, i, o))
+            continue;
+        if (!filename.empty() || !std::strncmp(argv[i], "--", 2)) {
+            filename.clear();
+            break;
+        }
+        filename = argv[i];
+    }
+    if (filename.empty()) {
+        std::cout << genHelp << std::endl;
+        return 0;
+    }
+
+    std::FILE* out = filename == "-" ? stdout : std::fopen(filename.c_str(), "w");
+    if (!out) {
+        std::cerr << "Couldn't create output file: " << filename << std::endl;
+        return 1;
+    }
+    uint64_t lines = generateLog(o, out);
+    bool ok = !std::ferror(out);
+    if (out != stdout)
+        ok = !std::fclose(out) && ok;
+    std::cerr << "Wrote " << lines << " lines." << std::endl;
+    return ok ? 0 : 1;
+}
+
+/* One run of the benchmark. */
+struct BenchRun {
+    double wall = 0;
+    double cpu = 0;
+    long peakRss = 0; // KB.
+    Timings timings;
+};
+
+/* Parse the log in a process of its own, so the peak RSS is this run's
+alone. The child sends its stage times back through a pipe. */
+bool benchRun(const Options& options, BenchRun& r)
+{
+    int p[2];
+    if (!makePipe(p))
+        return false;
+
+    auto started = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(p[0]);
+        std::ostream quiet(nullptr);
+        status = &quiet;
+        Timings t;
+        int ret = parseLog(options, &t);
+        writeAll(p[1], reinterpret_cast<const char*>(&t), sizeof(t));
+        _exit(ret);
+    }
+    close(p[1]);
+    if (pid < 0) {
+        close(p[0]);
+        return false;
+    }
+
+    ssize_t n = read(p[0], &r.timings, sizeof(r.timings));
+    close(p[0]);
+    int st;
+    struct rusage usage;
+    if (wait4(pid, &st, 0, &usage) < 0)
+        return false;
+    r.wall = secondsSince(started);
+    r.cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+            + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    r.peakRss = usage.ru_maxrss;
+#ifdef __APPLE__
+    r.peakRss /= 1024; // Bytes there.
+#endif
+    return n == sizeof(r.timings) && WIFEXITED(st) && !WEXITSTATUS(st);
+}
+
+/* bench: make a log, parse it with every engine, and tell how fast it went
+and how much memory it took. So we see a regression before it ships. */
+int bench(int argc, char** argv)
+{
+    GenOptions o;
+    int runs = 3;
+    bool keep = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (parseGenOption(argc, argv, i, o))
+            continue;
+        if (arg == "--runs" && i + 1 < argc) {
+            runs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--keep") {
+            keep = true;
+        } else {
+            std::cout << genHelp << std::endl;
+            return 0;
+        }
+    }
+
+    const char* tmp = std::getenv("TMPDIR");
+    std::string path = std::string(tmp && *tmp ? tmp : "/tmp")
+            + "/parsewinelog-bench-XXXXXX.log";
+    int fd = mkstemps(&path[0], 4);
+    std::FILE* out = fd >= 0 ? fdopen(fd, "w") : nullptr;
+    if (!out) {
+        std::cerr << "Couldn't create the log in " << path << std::endl;
+        return 1;
+    }
+
+    std::cout << "Generating " << (o.size >> 20) << " MB, " << o.threads
+            << " threads, depth " << o.depth << ", " << o.unmatched * 100
+            << "% unmatched, " << o.noise * 100 << "% noise..." << std::endl;
+    auto started = std::chrono::steady_clock::now();
+    uint64_t lines = generateLog(o, out);
+    bool ok = !std::ferror(out);
+    ok = !std::fclose(out) && ok;
+    struct stat st;
+    if (!ok || stat(path.c_str(), &st) != 0) {
+        std::cerr << "Couldn't write the log." << std::endl;
+        unlink(path.c_str());
+        return 1;
+    }
+    std::cout << lines << " lines in " << std::fixed << std::setprecision(2)
+            << secondsSince(started) << " s: " << path << std::endl;
+
+    /* The engines, and the readers they get. */
+    struct Engine {
+        const char* name;
+        const char* engine;
+        bool map;
+    };
+    const Engine engines[] = {
+        {"chunked", "chunked", true},
+        {"pipeline", "pipeline", true},
+        {"pipeline/read", "pipeline", false},
+    };
+
+    std::cout << std::left << std::setw(15) << "engine" << std::right
+            << std::setw(9) << "MB/s" << std::setw(12) << "lines/s"
+            << std::setw(9) << "wall s" << std::setw(9) << "cpu s"
+            << std::setw(9) << "RSS MB" << std::setw(9) << "parse s"
+            << std::setw(10) << "output s" << std::endl;
+
+    int ret = 0;
+    for (const auto& e : engines) {
+        Options options;
+        options.engine = e.engine;
+        options.map = e.map;
+        options.filename = path;
+
+        /* The best run, the others had more noise. */
+        BenchRun best;
+        bool failed = false;
+        for (int i = 0; i < runs; ++i) {
+            BenchRun r;
+            if (!benchRun(options, r)) {
+                failed = true;
+                break;
+            }
+            if (!i || r.wall < best.wall)
+                best = r;
+        }
+        if (failed) {
+            std::cout << std::left << std::setw(15) << e.name << "failed"
+                    << std::endl;
+            ret = 1;
+            continue;
+        }
+
+        std::cout << std::left << std::setw(15) << e.name << std::right
+                << std::setprecision(1) << std::setw(9)
+                << st.st_size / 1e6 / best.wall << std::setw(12)
+                << std::setprecision(0) << lines / best.wall
+                << std::setprecision(2) << std::setw(9) << best.wall
+                << std::setw(9) << best.cpu << std::setprecision(1)
+                << std::setw(9) << best.peakRss / 1024.0
+                << std::setprecision(2) << std::setw(9) << best.timings.parse
+                << std::setw(10) << best.timings.output << std::endl;
+    }
+
+    /* The output of the runs, and the log unless we keep it. */
+    std::string parsed = path.substr(0, path.size() - 4) + "_parsed.log";
+    unlink(parsed.c_str());
+    if (!keep)
+        unlink(path.c_str());
+    return ret;
+}
+
+/* Our own output isn't a log. Neither are the index, the --follow state and
+what a run that didn't get to rename them left behind. */
+bool isOurOutput(const std::string& name)
+{
+    if (name.find("_parsed") != std::string::npos)
+        return true;
+    for (const char* suffix : {".pwi", ".pws", ".tmp"}) {
+        size_t n = std::strlen(suffix);
+        if (name.size() > n && !name.compare(name.size() - n, n, suffix))
+            return true;
+    }
+    return false;
+}
+
+/* The logs in a directory, in order. */
+void listLogs(const std::string& dir, std::vector<std::string>& files)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+        return;
+    std::vector<std::string> found;
+    while (struct dirent* e = readdir(d)) {
+        std::string name = e->d_name;
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if (name[0] == '.' || stat(path.c_str(), &st) != 0
+                || !S_ISREG(st.st_mode) || isOurOutput(name))
+            continue;
+        found.push_back(path);
+    }
+    closedir(d);
+    std::sort(found.begin(), found.end());
+    files.insert(files.end(), found.begin(), found.end());
+}
+
+/* The logs we were given: files, directories, and globs the shell didn't
+expand because they were quoted. */
+std::vector<std::string> expandInputs(const std::vector<std::string>& inputs)
+{
+    std::vector<std::string> files;
+    for (const auto& x : inputs) {
+        struct stat st;
+        if (stat(x.c_str(), &st) == 0) {
+            if (S_ISDIR(st.st_mode))
+                listLogs(x, files);
+            else
+                files.push_back(x);
+            continue;
+        }
+
+        glob_t g;
+        if (x.find_first_of("*?[") != std::string::npos
+                && glob(x.c_str(), 0, nullptr, &g) == 0) {
+            for (size_t i = 0; i < g.gl_pathc; ++i) {
+                if (!isOurOutput(g.gl_pathv[i]))
+                    files.push_back(g.gl_pathv[i]);
+            }
+            globfree(&g);
+        } else {
+            files.push_back(x); // parseLog tells them it isn't there.
+        }
+    }
+    return files;
+}
+
+/* Many logs in one go, instead of a process with a pool of its own for
+every one of them, all fighting over the cores. The big logs go through the
+whole pool, one after the other, they keep it busy on their own. A small one
+would only keep a thread or two busy, so several of them run next to each
+other, each on a pool of one. That is a reader and a worker, so half as
+many runners as we have cores, and they share --max-mem. A runner done with
+its log takes the next one from the list, nobody idles while there is work.
+Their messages are kept until they are done, so they don't get mixed up. */
+int batch(Options options, const std::vector<std::string>& files)
+{
+    static const uint64_t bigLog = 64 << 20;
+
+    std::vector<std::string> small;
+    int failed = 0;
+    for (const auto& f : files) {
+        struct stat st;
+        if (stat(f.c_str(), &st) == 0 && static_cast<uint64_t>(st.st_size) < bigLog) {
+            small.push_back(f);
+            continue;
+        }
+        options.filename = f;
+        failed += parseLog(options) != 0;
+    }
+
+    std::atomic<size_t> next{0};
+    std::atomic<int> smallFailed{0};
+    std::mutex mutex; // For std::cout.
+    size_t count = std::min<size_t>(small.size(), std::max<size_t>(1,
+            (options.threads ? options.threads : cpuCount()) / 2));
+    auto run = [&] {
+        for (size_t i; (i = next.fetch_add(1)) < small.size();) {
+            std::ostringstream messages;
+            status = &messages;
+            Options o = options;
+            o.filename = small[i];
+            o.threads = 1;
+            o.pin = false; // They would all want the same CPUs.
+            o.progress = false;
+            o.maxMem = options.maxMem / count;
+            o.reports = &messages;
+            if (parseLog(o))
+                ++smallFailed;
+            std::lock_guard<std::mutex> lock(mutex);
+            std::cout << messages.str() << std::flush;
+        }
+    };
+    std::vector<std::thread> runners;
+    for (size_t i = 0; i < count; ++i)
+        runners.emplace_back(run);
+    for (auto& t : runners)
+        t.join();
+
+    failed += smallFailed;
+    *status << files.size() << " logs, " << failed << " failed." << std::endl;
+    return failed ? 1 : 0;
+}
+
+std::string extractHelp = "Usage: parsewinelog extract [options] yourlog.txt\n"
+        "  --thread ID,...   the lines of these Wine threads, ids in hex\n"
+        "  --lines X-Y       lines X to Y, from 1. X- goes to the end\n"
+        "  --tree DLL.Function,...  the calls of these, and everything their\n"
+        "                    thread did until they returned\n"
+        "The options narrow each other down, --tree takes the calls in the\n"
+        "lines asked for. The lines go to stdout as they are in the log.\n"
+        "yourlog.txt.pwi is used if it is there, see --index.";
+
+/* A byte range of the log a Wine thread did something in, for extract. */
+struct Span {
+    uint64_t begin;
+    uint64_t end;
+    unsigned int threadId;
+};
+
+/* Call every line of [begin, end) of the mapping, a block at a time. */
+template <typename F>
+void forEachLine(const char* data, uint64_t begin, uint64_t end, F f)
+{
+    std::vector<Line> lines;
+    Dialect dialect = sniffDialect(Slice(data + begin, end - begin));
+    while (begin < end) {
+        uint64_t blockEnd = end;
+        if (end - begin > InputReader::blockSize) {
+            auto nl = static_cast<const char*>(std::memchr(
+                    data + begin + InputReader::blockSize, '\n',
+                    end - begin - InputReader::blockSize));
+            if (nl)
+                blockEnd = nl + 1 - data;
+        }
+        scanLines(Slice(data + begin, blockEnd - begin), begin, lines, dialect);
+        for (const auto& line : lines)
+            f(line);
+        begin = blockEnd;
+    }
+}
+
+/* The line marks of a log without an index. Every thread counts the
+newlines of a part of it, the sums tell where the parts start. */
+std::vector<LineMark> countLines(const char* data, uint64_t size)
+{
+    size_t n = cpuCount();
+    std::vector<uint64_t> starts(1, 0);
+    for (size_t i = 1; i < n; ++i) {
+        uint64_t at = std::max(starts.back(), size / n * i);
+        auto nl = static_cast<const char*>(std::memchr(data + at, '\n', size - at));
+        if (!nl)
+            break;
+        starts.push_back(nl + 1 - data);
+    }
+    starts.push_back(size);
+
+    std::vector<uint64_t> counts(starts.size() - 1);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        threads.emplace_back([&, i] {
+            counts[i] = std::count(data + starts[i], data + starts[i + 1], '\n');
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    std::vector<LineMark> marks;
+    uint64_t line = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        LineMark m = {starts[i], line};
+        marks.push_back(m);
+        line += counts[i];
+    }
+    return marks;
+}
+
+/* Where line n starts, from the closest mark in front of it. The end of the
+log if there are fewer lines. */
+uint64_t lineOffset(const std::vector<LineMark>& marks, const char* data,
+        uint64_t size, uint64_t n)
+{
+    auto it = std::upper_bound(marks.begin(), marks.end(), n,
+            [](uint64_t x, const LineMark& m) { return x < m.line; });
+    if (it == marks.begin())
+        return 0;
+    --it;
+    uint64_t at = it->offset;
+    for (uint64_t line = it->line; line < n && at < size; ++line) {
+        auto nl = static_cast<const char*>(std::memchr(data + at, '\n', size - at));
+        at = nl ? nl + 1 - data : size;
+    }
+    return at;
+}
+
+/* The call trees of extract --tree. A call of a root function opens a span
+of its Wine thread, its ret closes it. They are matched like the threads
+match them, the top of the stack first, then further down. A root cut off by
+a ret matching below it ends right there, one that never returns goes to the
+end. */
+struct TreeMatcher {
+    static const size_t noSpan = ~size_t(0);
+
+    struct Pending {
+        Parser call;
+        size_t span; // Of a root.
+    };
+
+    TreeMatcher(const Filter& r, NameTable& n) : roots(r), names(n) {}
+
+    void add(const Batch::Entry& e)
+    {
+        const CallRecord& r = e.record;
+        if (e.kind == CallLine) {
+            Pending p = {Parser(r, e.size, r.offset), noSpan};
+            if (isRoot(r.function)) {
+                p.span = spans.size();
+                Span s = {r.offset, std::numeric_limits<uint64_t>::max(),
+                        r.threadId};
+                spans.push_back(s);
+            }
+            stacks[r.threadId].push_back(p);
+            return;
+        }
+
+        auto it = stacks.find(r.threadId);
+        if (it == stacks.end())
+            return;
+        std::vector<Pending>& calls = it->second;
+        for (size_t i = calls.size(); i-- > 0;) {
+            if (!calls[i].call(r))
+                continue;
+            close(calls[i], r.offset + e.size);
+            for (size_t j = i + 1; j < calls.size(); ++j)
+                close(calls[j], r.offset);
+            calls.erase(calls.begin() + i, calls.end());
+            return;
+        }
+    }
+
+    /* The roots still open end at end. */
+    void finish(uint64_t end)
+    {
+        for (auto& s : spans)
+            s.end = std::min(s.end, end);
+    }
+
+    void close(const Pending& p, uint64_t end)
+    {
+        if (p.span != noSpan)
+            spans[p.span].end = end;
+    }
+
+    bool isRoot(unsigned int function)
+    {
+        while (verdicts.size() <= function)
+            verdicts.push_back(roots.keep(names.name(verdicts.size())));
+        return verdicts[function];
+    }
+
+    const Filter& roots;
+    NameTable& names;
+    std::vector<bool> verdicts; // By function id.
+    std::vector<Span> spans; // In the order they were opened.
+    std::unordered_map<unsigned int, std::vector<Pending>> stacks;
+};
+
+/* extract: the lines of some Wine threads, some lines, or some call trees,
+without running the whole log through the matching. With an index the calls
+and rets are already there, and only the spans found are read. */
+int extract(int argc, char** argv)
+{
+    std::vector<unsigned int> threads;
+    uint64_t first = 0;
+    uint64_t last = std::numeric_limits<uint64_t>::max(); // Past the end.
+    Filter tree;
+    std::string filename;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--thread" && i + 1 < argc) {
+            for (const char* p = argv[++i]; *p; ++p) {
+                char* end;
+                threads.push_back(std::strtoul(p, &end, 16));
+                p = end;
+                if (!*p)
+                    break;
+            }
+        } else if (arg == "--lines" && i + 1 < argc) {
+            char* end;
+            first = std::strtoull(argv[++i], &end, 10);
+            first -= first > 0;
+            if (*end == '-')
+                last = end[1] ? std::strtoull(end + 1, nullptr, 10) : last;
+            else
+                last = first + 1;
+        } else if (arg == "--tree" && i + 1 < argc) {
+            tree.add(argv[++i], true);
+        } else if (filename.empty() && arg.compare(0, 2, "--")) {
+            filename = arg;
+        } else {
+            filename.clear();
+            break;
+        }
+    }
+    if (filename.empty()) {
+        std::cout << extractHelp << std::endl;
+        return 0;
+    }
+
+    status = &std::cerr;
+    std::unique_ptr<InputReader> inFile = openInFile(filename);
+    if (!inFile)
+        return 1;
+    const char* data = inFile->mapping();
+    if (!data) {
+        *status << "extract needs a regular file it can map." << std::endl;
+        return 1;
+    }
+
+    IndexFile index;
+    bool indexed = index.open(filename + ".pwi", fileSize, modifiedTime(filename));
+    if (indexed)
+        *status << "Reading the index: " << filename << ".pwi" << std::endl;
+
+    /* The bytes of the lines asked for. */
+    uint64_t begin = 0;
+    uint64_t end = fileSize;
+    if (first > 0 || last != std::numeric_limits<uint64_t>::max()) {
+        std::vector<LineMark> marks = indexed
+                ? std::vector<LineMark>(index.marks,
+                        index.marks + index.header->marks)
+                : countLines(data, fileSize);
+        begin = lineOffset(marks, data, fileSize, first);
+        end = lineOffset(marks, data, fileSize, std::max(first, last));
+    }
+
+    /* Where to look, and for which Wine thread. Without a tree it is all
+    of them, in the whole range. */
+    std::vector<Span> spans;
+    if (tree.empty()) {
+        Span s = {begin, end, 0};
+        spans.push_back(s);
+    } else {
+        NameTable names;
+        TreeMatcher matcher(tree, names);
+        if (indexed) {
+            for (size_t i = 0; i < index.header->names; ++i)
+                names.intern(index.name(i));
+            const uint64_t* offsets = index.offsets;
+            uint64_t records = index.header->records;
+            for (uint64_t i = std::lower_bound(offsets, offsets + records, begin)
+                    - offsets; i < records && offsets[i] < end; ++i)
+                matcher.add(index.entry(i));
+        } else {
+            forEachLine(data, begin, end, [&](const Line& line) {
+                if (line.kind == OtherLine)
+                    return;
+                Batch::Entry e = makeEntry(line);
+                e.record.function = line.kind == CallLine
+                        ? names.intern(parseFunction(line))
+                        : names.find(parseFunction(line));
+                matcher.add(e);
+            });
+        }
+        matcher.finish(end);
+        for (const auto& s : matcher.spans) {
+            if (threads.empty() || std::count(threads.begin(), threads.end(),
+                    s.threadId))
+                spans.push_back(s);
+        }
+    }
+
+    /* The spans of a thread can nest or overlap, merge them. The lines of
+    a thread are then in one of its spans or not. */
+    std::unordered_map<unsigned int, std::vector<Span>> byThread;
+    for (const auto& s : spans) {
+        auto& v = byThread[s.threadId];
+        if (!v.empty() && s.begin <= v.back().end)
+            v.back().end = std::max(v.back().end, s.end);
+        else
+            v.push_back(s);
+    }
+    std::unordered_map<unsigned int, size_t> next; // Their next span.
+
+    /* And all of them, what we read. */
+    std::sort(spans.begin(), spans.end(), [](const Span& a, const Span& b) {
+        return a.begin < b.begin;
+    });
+    std::vector<Span> ranges;
+    for (const auto& s : spans) {
+        if (!ranges.empty() && s.begin <= ranges.back().end)
+            ranges.back().end = std::max(ranges.back().end, s.end);
+        else
+            ranges.push_back(s);
+    }
+
+    OutputSink out(dup(STDOUT_FILENO));
+    out.setMapping(data, fileSize);
+    uint64_t written = 0;
+    for (const auto& r : ranges) {
+        forEachLine(data, r.begin, r.end, [&](const Line& line) {
+            if (!threads.empty() && !std::count(threads.begin(), threads.end(),
+                    line.threadId))
+                return;
+            if (!tree.empty()) {
+                auto it = byThread.find(line.threadId);
+                if (it == byThread.end())
+                    return;
+                size_t& i = next[line.threadId];
+                const std::vector<Span>& v = it->second;
+                while (i < v.size() && v[i].end <= line.offset)
+                    ++i;
+                if (i == v.size() || v[i].begin > line.offset)
+                    return;
+            }
+            out.line(line.text);
+            ++written;
+        });
+    }
+    bool ok = out.finish();
+    *status << "Extracted " << written << " lines." << std::endl;
+    return ok ? 0 : 1;
+}
+
+std::string dumpHelp = "Usage: parsewinelog dump [--unmatched] yourlog_parsed.txt.pwb\n"
+        "  --unmatched  only the calls that are in the text output\n"
+        "The calls of --binary output as text, a line each in input order:\n"
+        "offset in the log, thread, function, return address, matched or\n"
+        "unmatched, and the timestamp if the log has them.";
+
+/* dump: --binary output back to text, for people and for checking. */
+int dump(int argc, char** argv)
+{
+    bool unmatchedOnly = false;
+    std::string filename;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--unmatched") {
+            unmatchedOnly = true;
+        } else if (filename.empty() && arg.compare(0, 2, "--")) {
+            filename = arg;
+        } else {
+            filename.clear();
+            break;
+        }
+    }
+    if (filename.empty()) {
+        std::cout << dumpHelp << std::endl;
+        return 0;
+    }
+
+    status = &std::cerr;
+    BinaryFile file;
+    if (!file.open(filename)) {
+        *status << "Not --binary output: " << filename << std::endl;
+        return 1;
+    }
+
+    OutputSink out(dup(STDOUT_FILENO));
+    const BinaryHeader& h = *file.header;
+    char line[64];
+    std::string text;
+    for (uint64_t i = 0; i < h.calls; ++i) {
+        unsigned char f = file.flags[i];
+        if (unmatchedOnly && (f & IndexMatched))
+            continue;
+        snprintf(line, sizeof(line), "%" PRIu64 " %04x ", file.offsets[i],
+                file.threads[i]);
+        text = line;
+        Slice name = file.name(file.functions[i]);
+        text.append(name.data, name.size);
+        if (f & IndexRetAddr)
+            snprintf(line, sizeof(line), " ret=%08" PRIx64, file.retAddrs[i]);
+        else
+            snprintf(line, sizeof(line), " ret=-");
+        text += line;
+        text += f & IndexMatched ? " matched" : " unmatched";
+        if (f & IndexTime) {
+            snprintf(line, sizeof(line), " %u.%03u", file.times[i] / 1000,
+                    file.times[i] % 1000);
+            text += line;
+        }
+        out.line(Slice(text.data(), text.size()));
+    }
+    bool ok = out.finish();
+    *status << "Dumped " << h.calls << " calls, " << h.unmatched
+            << " unmatched." << std::endl;
+    return ok ? 0 : 1;
+}
+
+/* Read the options and get to work. gen, bench, extract and dump are tools
+of their own. */
+int main(int argc, char** argv)
+{
+    status = &std::cout;
+    if (argc > 1 && !std::strcmp(argv[1], "gen"))
+        return gen(argc - 1, argv + 1);
+    if (argc > 1 && !std::strcmp(argv[1], "bench"))
+        return bench(argc - 1, argv + 1);
+    if (argc > 1 && !std::strcmp(argv[1], "extract"))
+        return extract(argc - 1, argv + 1);
+    if (argc > 1 && !std::strcmp(argv[1], "dump"))
+        return dump(argc - 1, argv + 1);
+
+    /* Read the options, the logs are what is left. */
+    Options options;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--engine" && i + 1 < argc) {
+            options.engine = argv[++i];
+        } else if (arg == "--zstd") {
+            options.zstd = true;
+        } else if (arg == "--no-mmap") {
+            options.map = false;
+        } else if ((arg == "--include" || arg == "--exclude") && i + 1 < argc) {
+            options.filter.add(argv[++i], arg == "--include");
+        } else if (arg == "--summary") {
+            options.summary = true;
+        } else if (arg == "--index") {
+            options.index = true;
+        } else if (arg == "--binary") {
+            options.binary = true;
+        } else if (arg == "--profile") {
+            options.profile = true;
+        } else if (arg == "--top" && i + 1 < argc) {
+            options.top = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--pin") {
+            options.pin = true;
+        } else if (arg == "--max-mem" && i + 1 < argc) {
+            options.maxMem = std::strtoull(argv[++i], nullptr, 10) << 20;
+        } else if (arg == "--follow") {
+            options.follow = true;
+        } else if (arg == "--resume") {
+            options.resume = true;
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "--stats-json" && i + 1 < argc) {
+            options.statsJson = argv[++i];
+        } else if (arg == "-" || arg.compare(0, 2, "--")) {
+            inputs.push_back(arg);
+        } else {
+            inputs.clear();
+            break;
+        }
+    }
+
+    /* Print Help */
+    const std::string& engine = options.engine;
+    if (inputs.empty()
+            || (engine != "auto" && engine != "chunked" && engine != "pipeline")) {
+        std::cout << help << std::endl;
+        return 0;
+    }
+    timeStages = options.stats || !options.statsJson.empty();
+    profileCalls = options.profile;
+
+    /* One log, or many. */
+    struct stat st;
+    const std::string& first = inputs[0];
+    bool many = stat(first.c_str(), &st) == 0 ? S_ISDIR(st.st_mode)
+            : first.find_first_of("*?[") != std::string::npos;
+    if (inputs.size() == 1 && !many) {
+        options.filename = first;
+        if (options.follow || options.resume)
+            return followLog(options, options.follow);
+        return parseLog(options);
+    }
+    if (options.follow || options.resume) {
+        std::cout << "--follow and --resume only work with one log." << std::endl;
+        return 1;
+    }
+    if (std::count(inputs.begin(), inputs.end(), "-")
+            || !options.statsJson.empty()) {
+        std::cout << "- and --stats-json only work with one log." << std::endl;
+        return 1;
+    }
+    return batch(options, expandInputs(inputs));
 }